@@ -1,20 +1,105 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#endif
 #include "jv.h"
 
 
+#if defined(__GNUC__) || defined(__clang__)
+#define JVPOPCOUNT(x) __builtin_popcountll(x)
+#define JVCTZ(x) __builtin_ctzll(x)
+#define JVCLZ(x) __builtin_clzll(x)
+#else
+static int JVPOPCOUNT(uint64_t x) {
+    int n = 0;
+    for (; x; x &= x - 1) n++;
+    return n;
+}
+static int JVCTZ(uint64_t x) {
+    int n = 0;
+    for (; !(x & 1); x >>= 1) n++;
+    return n;
+}
+static int JVCLZ(uint64_t x) {
+    int n = 0;
+    for (; !(x >> 63); x <<= 1) n++;
+    return n;
+}
+#endif
+
+#define JVONES 0x0101010101010101ULL
+#define JVHIGH 0x8080808080808080ULL
+
+
 void init_output(struct output_t *out, FILE *fp, char *mem, size_t size) {
     out->fp = fp;
     out->mem = mem;
     out->mem_pos = mem;
     out->mem_size = size;
+    out->arena = NULL;
+    out->slice = NULL;
+    out->slice_len = 0;
+    out->indent = JVRAW;
+    out->encoding = ENCODE_JSON;
+    out->format.active = 0;
 }
 
-int capture(const char *string, size_t len, struct output_t *out) {
-    size_t num;
+void init_arena_output(struct output_t *out, struct arena_t *arena) {
+    init_output(out, NULL, NULL, 0);
+    out->arena = arena;
+}
 
-    if (out == NULL) return OK;
+
+void init_arena(struct arena_t *arena) {
+    arena->data = NULL;
+    arena->size = 0;
+    arena->used = 0;
+}
+
+void reset_arena(struct arena_t *arena) {
+    arena->used = 0;
+    if (arena->data != NULL) arena->data[0] = '\0';
+}
+
+void free_arena(struct arena_t *arena) {
+    free(arena->data);
+    init_arena(arena);
+}
+
+int arena_append(struct arena_t *arena, const char *string, size_t len) {
+    size_t size;
+    char *data;
+
+    if (arena->used + len + 1 > arena->size) {
+        size = (arena->size > 0) ? arena->size : JVBUF;
+        while (arena->used + len + 1 > size) size *= 2;
+        data = (char *)realloc(arena->data, size);
+        if (data == NULL) return OUT_OF_MEMORY;
+        arena->data = data;
+        arena->size = size;
+    }
+
+    memcpy(arena->data + arena->used, string, len);
+    arena->used += len;
+    arena->data[arena->used] = '\0';
+    return OK;
+}
+
+static int format_chars(const char *string, size_t len, struct output_t *out);
+
+/**
+ *  Write characters to every destination of an output, as they are.
+ */
+
+static int emit(const char *string, size_t len, struct output_t *out) {
+    size_t num;
 
     if (out->fp != NULL) {
         num = fwrite(string, JVBYTE, len, out->fp);
@@ -36,9 +121,22 @@ int capture(const char *string, size_t len, struct output_t *out) {
         }
     }
 
+    if (out->arena != NULL) {
+        if (arena_append(out->arena, string, len) != OK) return OUT_OF_MEMORY;
+    }
+
     return OK;
 }
 
+int capture(const char *string, size_t len, struct output_t *out) {
+    if (out == NULL) return OK;
+
+    if (out->format.active && out->indent != JVRAW) {
+        return format_chars(string, len, out);
+    }
+    return emit(string, len, out);
+}
+
 
 int get_key(const char *path, struct key_t *key) {
 #ifdef JVDEBUG
@@ -52,10 +150,15 @@ int get_key(const char *path, struct key_t *key) {
             return EMPTY_PATH_STRING;
         }
         case '[': {
-            if (path[1] >= '0' && path[1] <= '9') {
+            if ((path[1] >= '0' && path[1] <= '9') ||
+                    (path[1] == '-' && path[2] >= '1' && path[2] <= '9')) {
                 key->type = ARRAY_INDEX;
                 key->value = path + 1;
             }
+            else if (path[1] == '*') {
+                key->type = ARRAY_WILDCARD;
+                key->value = path + 1;
+            }
             else if (path[1] == '"') {
                 key->type = BRACKETED_NAME;
                 key->value = path + 2;
@@ -64,8 +167,14 @@ int get_key(const char *path, struct key_t *key) {
             break;
         }
         case '.': {
-            key->type = NAME;
-            key->value = path + 1;
+            if (path[1] == '.') {
+                key->type = RECURSIVE_NAME;
+                key->value = path + 2;
+            }
+            else {
+                key->type = NAME;
+                key->value = path + 1;
+            }
             break;
         }
         // Otherwise it's a name.
@@ -77,19 +186,24 @@ int get_key(const char *path, struct key_t *key) {
 
     // Now determine key end and beginning of next key.
     switch (key->type) {
-        case ARRAY_INDEX: {
+        case ARRAY_INDEX:
+        case ARRAY_WILDCARD: {
             chp = strchr(key->value, ']');
-            if (chp == NULL) {
+            if (chp == NULL || (key->type == ARRAY_WILDCARD && chp != key->value + 1)) {
                 return BAD_PATH_STRING;
             }
             key->len = chp - key->value;
             key->next = chp + 1;
             break;
         }
-        case NAME: {
+        case NAME:
+        case RECURSIVE_NAME: {
             chp = strpbrk(key->value, "[.");
             key->next = (chp == NULL) ? path + strlen(path) : chp;
             key->len = key->next - key->value;
+            if (key->type == RECURSIVE_NAME && key->len == 0) {
+                return BAD_PATH_STRING;
+            }
             break;
         }
         case BRACKETED_NAME: {
@@ -120,6 +234,17 @@ int get_key(const char *path, struct key_t *key) {
 }
 
 
+int path_walks(const char *path) {
+    struct key_t key;
+
+    while (path[0] != '\0' && get_key(path, &key) == OK) {
+        if (key.type == RECURSIVE_NAME || key.type == ARRAY_WILDCARD) return 1;
+        path = key.next;
+    }
+    return 0;
+}
+
+
 /**
  *  Read a new chunk of data from the JSON stream. Replaces the old
  *  buffer and sets the position to NULL.
@@ -129,6 +254,12 @@ int read(struct json_stream_t *stream) {
     size_t count;
     size_t buf_len;
 
+    // An in-memory stream has nothing more to give.
+    if (stream->src == NULL) return stream->code = END_OF_STREAM;
+
+    // A followed source may have grown since it last ended. Try again.
+    if (stream->follow && feof(stream->src)) clearerr(stream->src);
+
     if (feof(stream->src)) {
         // TODO: Should we leave it up to the caller to decide what
         // to do if the file ends?
@@ -142,6 +273,14 @@ int read(struct json_stream_t *stream) {
         stream->prev_char = stream->buffer[buf_len - 1];
     }
 
+    // The buffer is about to be replaced. Echo what has not been yet.
+    if (stream->echo != NULL) {
+        if (capture(stream->echo_pos, stream->buffer + buf_len - stream->echo_pos, stream->echo) != OK) {
+            return stream->code = STREAM_WRITE_ERROR;
+        }
+        stream->echo_pos = stream->buffer + buf_len;
+    }
+
     // Get more data from the stream.
     count = fread(stream->buffer, JVBYTE, JVBUF, stream->src);
     if (count != JVBUF) {
@@ -154,14 +293,14 @@ int read(struct json_stream_t *stream) {
             // TODO: Should we leave it up to the caller to decide what
             // to do if the file ends?
             return stream->code = END_OF_STREAM;
-            //exit(0);
         }
     }
 
+    stream->offset += buf_len;
     stream->buffer[count] = '\0';
     // Casts from array to pointer type. Subtle. See
     // http://stackoverflow.com/questions/1335786/c-differences-between-char-pointer-and-array
-    stream->pos = stream->buffer;
+    stream->pos = stream->span = stream->echo_pos = stream->buffer;
     return OK;
 }
 
@@ -175,7 +314,42 @@ int init_stream(struct json_stream_t *stream, FILE *src) {
 
     stream->buffer[0] = '\0'; // avoids set prev_char in read().
     stream->prev_char = '\0';
+    stream->echo = NULL;
+    stream->follow = 0;
+    stream->pos = stream->span = stream->buffer;
+
+    // Offsets are only meaningful for seekable sources; a pipe starts at 0.
+    stream->offset = ftell(src);
+    if (stream->offset < 0) stream->offset = 0;
+
+    return read(stream);
+}
+
+int init_stream_string(struct json_stream_t *stream, const char *json) {
+    stream->src = NULL;
+    stream->echo = NULL;
+    stream->follow = 0;
+    stream->buffer[0] = '\0';
+    stream->prev_char = '\0';
+    stream->offset = 0;
+    if (json[0] == '\0') return stream->code = END_OF_STREAM;
+    stream->pos = stream->span = json;
+    return OK;
+}
+
+
+long stream_offset(struct json_stream_t *stream) {
+    return stream->offset + (stream->pos - stream->span);
+}
 
+int seek_stream(struct json_stream_t *stream, long offset) {
+    if (stream->src == NULL || fseek(stream->src, offset, SEEK_SET) != 0) {
+        return stream->code = STREAM_READ_ERROR;
+    }
+    stream->buffer[0] = '\0';
+    stream->prev_char = '\0';
+    stream->echo_pos = stream->buffer;
+    stream->offset = offset;
     return read(stream);
 }
 
@@ -231,7 +405,7 @@ int search(struct json_stream_t *stream, const char *chars, struct output_t *out
         return stream->code = code;
     }
 
-    if (chp > stream->buffer) {
+    if (chp > stream->span) {
         stream->prev_char = *(chp - 1); // Dangerous, but we know.
     }
     stream->pos = chp;
@@ -240,39 +414,339 @@ int search(struct json_stream_t *stream, const char *chars, struct output_t *out
 }
 
 
-int traverse_collection(struct json_stream_t *stream, char open, int count, struct output_t *out) {
-    char match_chars[4] = {'\0', '\0', '"', '\0'};
-    char ch = 0;
-    char close;
-    int env = OBJECT;
+#ifndef __SSE2__
+/**
+ *  Load eight characters into a word, first character in the low byte. Written
+ *  out so it does not depend on endianness; compilers turn it into one load.
+ */
+
+static uint64_t load_word(const char *chars) {
+    const unsigned char *u = (const unsigned char *)chars;
+    return (uint64_t)u[0] | (uint64_t)u[1] << 8 | (uint64_t)u[2] << 16 |
+        (uint64_t)u[3] << 24 | (uint64_t)u[4] << 32 | (uint64_t)u[5] << 40 |
+        (uint64_t)u[6] << 48 | (uint64_t)u[7] << 56;
+}
 
-    match_chars[0] = open;
-    close = match_chars[1] = (open == '{') ? '}' : ']';
+/**
+ *  One bit per character of word that equals ch, packed into the low byte.
+ */
 
-    if (stream->pos[0] == close) count--;
+static uint64_t match_word(uint64_t word, unsigned char ch) {
+    uint64_t x = word ^ (JVONES * ch);
+    // High bit of each byte is set iff that byte of x is zero. No borrows
+    // between bytes, so this is exact.
+    x = ~(((x & ~JVHIGH) + ~JVHIGH) | x) & JVHIGH;
+    // Gather the eight high bits into the top byte, then bring them down.
+    return ((x >> 7) * 0x0102040810204080ULL) >> 56;
+}
 
-    while (count > 0) {
-        if (search(stream, match_chars, out) != OK) {
-            return stream->code;
+/**
+ *  One bit per character of word below limit (at most 0x80), packed into the
+ *  low byte.
+ */
+
+static uint64_t below_word(uint64_t word, unsigned char limit) {
+    // With the high bit forced on, subtracting cannot borrow across bytes;
+    // the high bit survives iff the low seven bits are >= limit.
+    uint64_t x = ~(((word | JVHIGH) - JVONES * limit) | word) & JVHIGH;
+    return ((x >> 7) * 0x0102040810204080ULL) >> 56;
+}
+#endif
+
+/**
+ *  Bit i of the result is the parity of bits 0..i of x.
+ */
+
+static uint64_t prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+void classify_block(const char *chars, size_t len, struct scan_state_t *state, struct block_t *block) {
+    char padded[64];
+    uint64_t quote = 0;
+    uint64_t backslash = 0;
+    uint64_t open = 0;
+    uint64_t close = 0;
+    uint64_t comma = 0;
+    uint64_t colon = 0;
+    uint64_t space = 0;
+    uint64_t escaped;
+    uint64_t valid;
+    uint64_t bits;
+#ifndef __SSE2__
+    uint64_t word;
+#endif
+    int shift;
+    int i;
+
+    // Never read past the end of the caller's characters.
+    if (len < 64) {
+        memset(padded, ' ', 64);
+        memcpy(padded, chars, len);
+        chars = padded;
+    }
+    valid = (len < 64) ? ((uint64_t)1 << len) - 1 : ~(uint64_t)0;
+
+    // '[' and ']' are '{' and '}' with bit 0x20 cleared, so one comparison
+    // against the OR-ed character finds both.
+#ifdef __SSE2__
+    for (shift = 0; shift < 64; shift += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(chars + shift));
+        __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        quote |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << shift;
+        backslash |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << shift;
+        open |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{'))) << shift;
+        close |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))) << shift;
+        comma |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(','))) << shift;
+        colon |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(':'))) << shift;
+        // Unsigned v <= ' ' is max(v, ' ') == ' '.
+        space |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(' ')), _mm_set1_epi8(' '))) << shift;
+    }
+#else
+    for (shift = 0; shift < 64; shift += 8) {
+        word = load_word(chars + shift);
+        quote |= match_word(word, '"') << shift;
+        backslash |= match_word(word, '\\') << shift;
+        open |= match_word(word | (JVONES * 0x20), '{') << shift;
+        close |= match_word(word | (JVONES * 0x20), '}') << shift;
+        comma |= match_word(word, ',') << shift;
+        colon |= match_word(word, ':') << shift;
+        space |= below_word(word, ' ' + 1) << shift;
+    }
+#endif
+
+    // A backslash escapes the next character unless it is escaped itself.
+    escaped = state->escaped ? 1 : 0;
+    state->escaped = 0;
+    bits = backslash & valid;
+    while (bits) {
+        i = JVCTZ(bits);
+        bits &= bits - 1;
+        if ((escaped >> i) & 1) continue;
+        if ((size_t)i == len - 1) state->escaped = 1;
+        else escaped |= (uint64_t)1 << (i + 1);
+    }
+
+    block->string = prefix_xor(quote & ~escaped);
+    if (state->in_string) block->string = ~block->string;
+    block->string &= valid;
+    state->in_string = (int)((block->string >> (len - 1)) & 1);
+
+    block->open = open & valid & ~block->string;
+    block->close = close & valid & ~block->string;
+    block->comma = comma & valid & ~block->string;
+    block->colon = colon & valid & ~block->string;
+    block->space = space & valid & ~block->string;
+}
+
+int fast_forward(struct json_stream_t *stream, int depth, long limit, long *passed, struct output_t *out) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Fast-forwarding from depth %d\n", depth);
+#endif
+    struct scan_state_t state = {0, 0};
+    struct block_t block;
+    const char *span = stream->pos;
+    const char *chp = stream->pos;
+    size_t len = strlen(chp);
+    size_t n;
+    long commas = 0;
+    int counting = (limit >= 0 || passed != NULL);
+    int lowest;
+    uint64_t bits;
+    int i;
+    int code;
+
+    while (1) {
+        while (len > 0) {
+            n = (len < 64) ? len : 64;
+            classify_block(chp, n, &state, &block);
+
+            // If the depth cannot reach zero here (nor one, when commas
+            // matter), the whole block is just a change in depth.
+            lowest = depth - JVPOPCOUNT(block.close);
+            if (lowest > 1 || (lowest > 0 && !(counting && block.comma))) {
+                depth = lowest + JVPOPCOUNT(block.open);
+                chp += n;
+                len -= n;
+                continue;
+            }
+
+            bits = block.open | block.close | block.comma;
+            while (bits) {
+                i = JVCTZ(bits);
+                bits &= bits - 1;
+                if ((block.open >> i) & 1) {
+                    depth++;
+                    continue;
+                }
+                if ((block.close >> i) & 1) {
+                    if (--depth > 0) continue;
+                }
+                else if (depth != 1 || ++commas != limit) continue;
+
+                // Arrived.
+                code = capture(span, chp + i - span, out);
+                if (code != OK) return stream->code = code;
+                stream->pos = chp + i;
+                if (stream->pos > stream->span) {
+                    stream->prev_char = stream->pos[-1];
+                }
+                if (passed != NULL) *passed = commas;
+                return OK;
+            }
+            chp += n;
+            len -= n;
+        }
+
+        code = capture(span, chp - span, out);
+        if (code != OK) return stream->code = code;
+        if (read(stream) != OK) return stream->code;
+        span = chp = stream->pos;
+        len = strlen(chp);
+    }
+}
+
+
+/**
+ *  Start a new line at the formatter's depth.
+ */
+
+static int format_break(struct output_t *out) {
+    static const char spaces[] = "\n                                ";
+    int width = out->format.depth * out->indent;
+    int n;
+
+    if (emit(spaces, 1, out) != OK) return STREAM_WRITE_ERROR;
+    while (width > 0) {
+        n = (width < 32) ? width : 32;
+        if (emit(spaces + 1, n, out) != OK) return STREAM_WRITE_ERROR;
+        width -= n;
+    }
+    return OK;
+}
+
+/**
+ *  Capture characters of a collection, compacted or pretty-printed. The
+ *  same block masks the scanner uses say which characters are whitespace,
+ *  brackets, commas and colons outside strings; everything between those is
+ *  written out in runs.
+ */
+
+static int format_chars(const char *string, size_t len, struct output_t *out) {
+    struct format_t *fmt = &out->format;
+    struct block_t block;
+    uint64_t events;
+    size_t n;
+    int next;
+    int i;
+    int code = OK;
+    char ch;
+
+    for (; len > 0; string += n, len -= n) {
+        n = (len < 64) ? len : 64;
+        classify_block(string, n, &fmt->scan, &block);
+
+        if (out->indent == 0) {
+            // Compact: write the runs between whitespace.
+            events = block.space;
         }
-        ch = stream->pos[0];
+        else {
+            events = block.space | block.open | block.close | block.comma | block.colon;
+        }
+
+        i = 0;
+        while (i < (int)n && code == OK) {
+            next = events ? JVCTZ(events) : (int)n;
+            if (next > i) {
+                // A run of ordinary characters.
+                if (fmt->fresh) {
+                    fmt->fresh = 0;
+                    code = format_break(out);
+                    if (code != OK) break;
+                }
+                code = emit(string + i, next - i, out);
+                i = next;
+                continue;
+            }
 
-        if ((ch == '"') && (stream->prev_char != '\\')) {
-            // Change environment to/from STRING.
-            env = (env == STRING ? COLLECTION : STRING);
+            events &= events - 1;
+            ch = string[i++];
+            if ((block.space >> next) & 1) continue;
+
+            if (ch == '}' || ch == ']') {
+                fmt->depth--;
+                if (fmt->fresh) fmt->fresh = 0;
+                else code = format_break(out);
+                if (code == OK) code = emit(&ch, 1, out);
+                continue;
+            }
+
+            if (fmt->fresh) {
+                fmt->fresh = 0;
+                code = format_break(out);
+                if (code != OK) break;
+            }
+            if (ch == ':') {
+                code = emit(": ", 2, out);
+            }
+            else if (ch == ',') {
+                code = emit(",", 1, out);
+                if (code == OK) code = format_break(out);
+            }
+            else {
+                code = emit(&ch, 1, out);
+                fmt->depth++;
+                fmt->fresh = 1;
+            }
         }
-        else if (ch == open && env != STRING) count++;
-        else if (ch == close && env != STRING) count--;
+        if (code != OK) return code;
+    }
+    return OK;
+}
+
+
+int traverse_collection(struct json_stream_t *stream, char open, int count, struct output_t *out) {
+    char close = (open == '{') ? '}' : ']';
+
+    // The current character is already accounted for in count, unless it
+    // closes a level.
+    if (stream->pos[0] != close) {
+        if (bump(stream, out) != OK) return stream->code;
+    }
+
+    if (fast_forward(stream, count, -1, NULL, out) != OK) {
+        return stream->code;
     }
 
     return bump(stream, out);
 }
 
-int traverse_string(struct json_stream_t *stream, struct output_t *out) {
-    do {
-        if (search(stream, "\"", out) != OK) return stream->code;
+/**
+ *  Pass over the inside of a string. On input, the stream points to the first
+ *  character after the opening quote; on output, to the closing quote. A
+ *  backslash always takes the next character with it, so runs like \\" are
+ *  handled correctly.
+ */
+
+static int string_body(struct json_stream_t *stream, struct output_t *out) {
+    while (stream->pos[0] != '"') {
+        if (stream->pos[0] == '\\') {
+            if (bump(stream, out) != OK) return stream->code;
+        }
+        if (search(stream, "\"\\", out) != OK) return stream->code;
     }
-    while (stream->prev_char == '\\');
+    return OK;
+}
+
+int traverse_string(struct json_stream_t *stream, struct output_t *out) {
+    if (bump(stream, out) != OK) return stream->code;
+    if (string_body(stream, out) != OK) return stream->code;
     return bump(stream, out);
 }
 
@@ -292,6 +766,16 @@ int traverse_null(struct json_stream_t *stream, struct output_t *out) {
 }
 
 
+int traverse_boolean(struct json_stream_t *stream, struct output_t *out) {
+    int len = (stream->pos[0] == 't') ? 4 : 5;
+
+    while (len-- > 0) {
+        if (bump(stream, out) != OK) return stream->code;
+    }
+    return OK;
+}
+
+
 /**
  *  Skip functions. Pass over values without capturing their contents.
  */
@@ -324,6 +808,13 @@ int skip_null(struct json_stream_t *stream) {
     return traverse_null(stream, NULL);
 }
 
+int skip_boolean(struct json_stream_t *stream) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Skipping boolean.\n");
+#endif
+    return traverse_boolean(stream, NULL);
+}
+
 /**
  *  Stream must point to first character of value. On output,
  *  stream points to character just beyond value.
@@ -349,6 +840,8 @@ int skip_value(struct json_stream_t *stream) {
         case '8':
         case '9': return skip_number(stream);
         case 'n': return skip_null(stream);
+        case 't':
+        case 'f': return skip_boolean(stream);
         default: return stream->code = NOT_AT_VALUE;
     }
 }
@@ -359,14 +852,22 @@ const char *scan_object(struct json_stream_t *stream, const char *path) {
 #ifdef JVDEBUG
     fprintf(stdout, "Scanning object\n");
 #endif
+    const char *subpath;
+
+    // An array index never matches an object key.
+    if (path[0] == '[' && path[1] != '"') {
+        if (skip_collection(stream) != OK) return NULL;
+        return path;
+    }
+
     // Jump to the first '"' or closing '}'.
     if (search(stream, "\"}", NULL) != OK) return NULL;
 
     while (stream->pos[0] != '}') {
-        path = scan_pair(stream, path);
-        if (path == NULL || path[0] == '\0') {
+        subpath = scan_pair(stream, path);
+        if (subpath == NULL || subpath[0] == '\0') {
             // Error, or complete and utter success.
-            return path;
+            return subpath;
         }
         // Stream now points to char after skipped value.
         // This is one of: ",}\s". If not '}', run search for
@@ -379,7 +880,6 @@ const char *scan_object(struct json_stream_t *stream, const char *path) {
     // Stream points to '}'. Go just beyond the object, as ya do.
     if (bump(stream, NULL) != OK) return NULL;
 
-    // Sanity check that input path = subpath?
     return path;
 }
 
@@ -389,10 +889,9 @@ const char *scan_array(struct json_stream_t *stream, const char *path) {
     fprintf(stdout, "Scanning array\n");
 #endif
     struct key_t key;
+    const char *subpath;
     long int index;
-    long int i;
     int code;
-    char ch;
 
     code = get_key(path, &key);
     if (code != OK) {
@@ -400,42 +899,53 @@ const char *scan_array(struct json_stream_t *stream, const char *path) {
         return NULL;
     }
 
+    if (key.type == RECURSIVE_NAME || key.type == ARRAY_WILDCARD) {
+        // Look inside every element until something matches.
+        if (search(stream, ELEMENT_TIPS, NULL) != OK) return NULL;
+        while (stream->pos[0] != ']') {
+            subpath = scan_value(stream, (key.type == RECURSIVE_NAME) ? path : key.next);
+            if (subpath == NULL || subpath[0] == '\0') return subpath;
+            if (stream->pos[0] != ']') {
+                if (search(stream, ELEMENT_TIPS, NULL) != OK) return NULL;
+            }
+        }
+        if (bump(stream, NULL) != OK) return NULL;
+        return path;
+    }
+
     if (key.type != ARRAY_INDEX) {
+        if (skip_collection(stream) != OK) return NULL;
         return path;
     }
 
     index = strtol(key.value, NULL, 10);
-    if (index == 0L && key.value[0] != '0') {
+    if ((index == 0L && key.value[0] != '0') || index < 0) {
+        // Negative indices are for scan_tail().
         stream->code = ARRAY_INDEX_ERROR;
         return NULL;
     }
 
-    // Start the search!
-    for (i = 0; i <= index; i++) {
-        // Jump to value or closing ']'.
-        if (search(stream, "]{[\"0123456789-n", NULL) != OK) {
-            return NULL;
-        }
-        ch = stream->pos[0];
+    // Pass over the preceding elements in bulk. The stream lands on the
+    // comma before the element we want, or on ']' if there are too few.
+    if (index > 0 && fast_forward(stream, 0, index, NULL, NULL) != OK) {
+        return NULL;
+    }
 
-        if (ch == ']') return path;
-        else if (i == index) {
-            return scan_value(stream, key.next);
-        }
-        else if (skip_value(stream) != OK) {
-            return NULL;
-        }
-        // Value skipped. Check again for closing ']'.
-        if (stream->pos[0] == ']') return path;
+    // Jump to value or closing ']'.
+    if (stream->pos[0] != ']') {
+        if (search(stream, ELEMENT_TIPS, NULL) != OK) return NULL;
+    }
+    if (stream->pos[0] == ']') {
+        if (bump(stream, NULL) != OK) return NULL;
+        return path;
     }
 
-    // If we get out of the loop, we must skip the remaining
-    // elements. Stream is currently pointing to char after
-    // mismatched value.
+    subpath = scan_value(stream, key.next);
+    if (subpath == NULL || subpath[0] == '\0') return subpath;
 
-    if (traverse_collection(stream, '[', 1, NULL) != OK) {
-        return NULL;
-    }
+    // Not in this element. The stream is just past it; skip the rest.
+    if (fast_forward(stream, 1, -1, NULL, NULL) != OK) return NULL;
+    if (bump(stream, NULL) != OK) return NULL;
 
     return path;
 }
@@ -451,7 +961,7 @@ const char *scan_value(struct json_stream_t *stream, const char *path) {
     switch (stream->pos[0]) {
         case '{': return scan_object(stream, path);
         case '[': return scan_array(stream, path);
-        default: return path;
+        default: return (skip_value(stream) == OK) ? path : NULL;
     }
 
     return NULL;
@@ -481,14 +991,18 @@ const char *scan_key(struct json_stream_t *stream, const char *path) {
 #ifdef JVDEBUG
             fprintf(stdout, "  mismatch (path: %c, object: %c)\n", path_key.value[i], stream->pos[0]);
 #endif
-            while (stream->pos[0] != '"' || stream->prev_char == '\\') {
-                if (search(stream, "\"", NULL) != OK) return NULL;
-            }
+            if (string_body(stream, NULL) != OK) return NULL;
             return path;
         }
         if (bump(stream, NULL) != OK) return NULL;
     }
 
+    // The object key may be longer than the path key.
+    if (stream->pos[0] != '"') {
+        if (string_body(stream, NULL) != OK) return NULL;
+        return path;
+    }
+
     return path_key.next;
 }
 
@@ -507,63 +1021,820 @@ const char *scan_pair(struct json_stream_t *stream, const char *path) {
         return NULL;
     }
 
+    if (subpath == path && path[0] == '.' && path[1] == '.') {
+        // No key match, but the key may be further down.
+        return scan_value(stream, path);
+    }
     if (subpath == path) {
-        // No key match. Skip the value.
+        // No key match. Fast-forward to the next sibling.
 #ifdef JVDEBUG
         fprintf(stdout, "  key mismatch (%s), skipping value.\n", path);
 #endif
-        if (skip_value(stream) != OK) return NULL;
+        if (fast_forward(stream, 1, 1, NULL, NULL) != OK) return NULL;
         return path;
     }
-    else {
-        return scan_value(stream, subpath);
+
+    subpath = scan_value(stream, subpath);
+    if (subpath == NULL || subpath[0] == '\0') return subpath;
+    return path;
+}
+
+/**
+ *  Backward reading, for scan_tail().
+ */
+
+struct rstream_t {
+    FILE *src;
+
+    /**
+     *  A window of the source: the characters at offsets [start, start + len).
+     */
+
+    char buffer[JVBUF];
+    long start;
+    long len;
+
+    /**
+     *  Offset of the character read last. Reading goes toward limit, the
+     *  offset of the opening bracket of the array being read.
+     */
+
+    long pos;
+    long limit;
+};
+
+/**
+ *  Character at the given offset, reloading the window (so that it ends just
+ *  after that offset) if needed. Returns EOF on a read error.
+ */
+
+static int rstream_at(struct rstream_t *r, long offset) {
+    if (offset < r->start || offset >= r->start + r->len) {
+        r->start = offset + 1 - JVBUF;
+        if (r->start < r->limit) r->start = r->limit;
+        if (fseek(r->src, r->start, SEEK_SET) != 0) return EOF;
+        r->len = (long)fread(r->buffer, JVBYTE, offset + 1 - r->start, r->src);
+        if (offset >= r->start + r->len) return EOF;
     }
+    return (unsigned char)r->buffer[offset - r->start];
 }
 
 /**
- *  Pipe functions. Traverse values while capturing their contents.
+ *  Step back one character and return it, or EOF at the beginning.
  */
 
-int pipe_collection(struct json_stream_t *stream, struct output_t *out) {
-#ifdef JVDEBUG
-    fprintf(stdout, "Piping collection\n");
-#endif
-    return traverse_collection(stream, stream->pos[0], 1, out);
+static int rstream_back(struct rstream_t *r) {
+    if (r->pos <= r->limit) return EOF;
+    return rstream_at(r, --r->pos);
 }
 
-int pipe_string(struct json_stream_t *stream, struct output_t *out) {
-#ifdef JVDEBUG
-    fprintf(stdout, "Piping string\n");
-#endif
-    // Avoid capturing opening quote. Bump to first char. Check it b/c
-    // search won't include it.
-    if (bump(stream, NULL) != OK) return stream->code;
-    if (stream->pos[0] == '"') return OK; // Empty string.
+/**
+ *  Step back to the previous non-whitespace character and return it.
+ */
+
+static int rstream_back_space(struct rstream_t *r) {
+    int ch;
 
     do {
-        if (search(stream, "\"", out) != OK) return stream->code;
+        ch = rstream_back(r);
     }
-    while (stream->prev_char == '\\');
-
-    return bump(stream, NULL);
+    while (ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r');
+    return ch;
 }
 
-int pipe_number(struct json_stream_t *stream, struct output_t *out) {
-#ifdef JVDEBUG
-    fprintf(stdout, "Piping number\n");
-#endif
-    return traverse_number(stream, out);
-}
+/**
+ *  With the closing quote just read, step back to the opening quote. A quote
+ *  preceded by an odd run of backslashes is part of the string.
+ */
 
-int pipe_null(struct json_stream_t *stream, struct output_t *out) {
-#ifdef JVDEBUG
-    fprintf(stdout, "Piping null\n");
-#endif
-    return traverse_null(stream, out);
+static int rstream_back_string(struct rstream_t *r) {
+    int ch;
+    long run;
+
+    while (1) {
+        ch = rstream_back(r);
+        if (ch == EOF) return END_OF_STREAM;
+        if (ch != '"') continue;
+
+        run = 0;
+        while (r->pos - run > r->limit && rstream_at(r, r->pos - run - 1) == '\\') {
+            run++;
+        }
+        if (run % 2 == 0) return OK;
+        r->pos -= run;
+    }
 }
 
-int pipe_value(struct json_stream_t *stream, struct output_t *out) {
-    switch (stream->pos[0]) {
+/**
+ *  With the last character of a value just read (ch), step back to its
+ *  first character.
+ */
+
+static int rstream_back_value(struct rstream_t *r, int ch) {
+    int depth;
+
+    switch (ch) {
+        case '"': return rstream_back_string(r);
+        case '}':
+        case ']': {
+            depth = 1;
+            while (depth > 0) {
+                ch = rstream_back(r);
+                if (ch == EOF) return END_OF_STREAM;
+                if (ch == '"') {
+                    if (rstream_back_string(r) != OK) return END_OF_STREAM;
+                }
+                else if (ch == '}' || ch == ']') depth++;
+                else if (ch == '{' || ch == '[') depth--;
+            }
+            return OK;
+        }
+        default: {
+            // Numbers and literals.
+            while (r->pos > r->limit) {
+                ch = rstream_at(r, r->pos - 1);
+                if (ch == EOF || strchr("0123456789+-.eEtruefalsn", ch) == NULL) break;
+                r->pos--;
+            }
+            return OK;
+        }
+    }
+}
+
+/**
+ *  With r->pos on the closing ']' of an array, find its count-th element
+ *  from the end. The element occupies offsets [*start, *end). Returns
+ *  KEY_MISMATCH if the array is shorter than that.
+ */
+
+static int rstream_index(struct rstream_t *r, long count, long *start, long *end) {
+    int ch;
+
+    while (1) {
+        ch = rstream_back_space(r);
+        if (ch == '[') return KEY_MISMATCH;
+        if (ch == EOF) return END_OF_STREAM;
+
+        *end = r->pos + 1;
+        if (rstream_back_value(r, ch) != OK) return END_OF_STREAM;
+        *start = r->pos;
+        if (--count == 0) return OK;
+
+        ch = rstream_back_space(r);
+        if (ch == '[') return KEY_MISMATCH;
+        if (ch != ',') return NOT_AT_VALUE;
+    }
+}
+
+/**
+ *  The first negative array index in a path, or NULL if it has none.
+ */
+
+static const char *tail_key(const char *path) {
+    struct key_t key;
+
+    while (path[0] != '\0' && get_key(path, &key) == OK) {
+        if (key.type == ARRAY_INDEX && key.value[0] == '-') return path;
+        path = key.next;
+    }
+    return NULL;
+}
+
+const char *scan_tail(struct json_stream_t *stream, const char *path) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Scanning tail\n");
+#endif
+    struct rstream_t r;
+    struct key_t key;
+    const char *subpath = path;
+    const char *tail;
+    const char *rest;
+    char *prefix;
+    long start;
+    long end = -1;
+    int matched;
+    int code;
+
+    if (tail_key(path) == NULL) return scan_value(stream, path);
+
+    if (stream->src == NULL || ftell(stream->src) < 0) {
+        stream->code = ARRAY_INDEX_ERROR;
+        return NULL;
+    }
+    r.src = stream->src;
+    r.start = r.len = 0;
+
+    while ((tail = tail_key(subpath)) != NULL) {
+        for (rest = subpath; rest < tail; rest = key.next) {
+            code = get_key(rest, &key);
+            if (code != OK) {
+                stream->code = code;
+                return NULL;
+            }
+            if (key.type == RECURSIVE_NAME || key.type == ARRAY_WILDCARD) {
+                stream->code = ARRAY_INDEX_ERROR;
+                return NULL;
+            }
+        }
+
+        // The keys before the negative index are found forward, as
+        // scan_value() would find them.
+        if (tail > subpath) {
+            prefix = malloc(tail - subpath + 1);
+            if (prefix == NULL) {
+                stream->code = OUT_OF_MEMORY;
+                return NULL;
+            }
+            memcpy(prefix, subpath, tail - subpath);
+            prefix[tail - subpath] = '\0';
+            rest = scan_value(stream, prefix);
+            matched = (rest != NULL && rest[0] == '\0');
+            free(prefix);
+            if (rest == NULL) return NULL;
+            if (!matched) return path;
+            end = -1;
+        }
+        if (stream->pos[0] != '[') return path;
+
+        code = get_key(tail, &key);
+        if (code != OK) {
+            stream->code = code;
+            return NULL;
+        }
+
+        // A document with nothing but space in front of it runs to the end
+        // of the input.
+        if (subpath == path && tail == path) {
+            r.limit = 0;
+            r.pos = stream_offset(stream);
+            if (rstream_back_space(&r) == EOF && fseek(r.src, 0, SEEK_END) == 0) {
+                end = ftell(r.src);
+            }
+        }
+
+        // The opening bracket is the anchor: reading back never goes past
+        // it. If the end of the array is known (the end of the input, or of
+        // the element found last), its closing bracket is read back to from
+        // there. Otherwise the array is skipped in bulk: read from the end,
+        // an array in an object looks the same as a sibling after it.
+        r.limit = stream_offset(stream);
+        r.pos = end;
+        if (end < 0 || rstream_back_space(&r) != ']') {
+            if (fast_forward(stream, 0, -1, NULL, NULL) != OK) return NULL;
+            r.pos = stream_offset(stream);
+        }
+
+        code = rstream_index(&r, -strtol(key.value, NULL, 10), &start, &end);
+        if (code == KEY_MISMATCH) return path;
+        if (code != OK) {
+            stream->code = code;
+            return NULL;
+        }
+
+        // Continue inside the element found.
+        if (seek_stream(stream, start) != OK) return NULL;
+        subpath = key.next;
+    }
+
+    subpath = scan_value(stream, subpath);
+    if (subpath == NULL || subpath[0] == '\0') return subpath;
+    return path;
+}
+
+
+/**
+ *  Walk functions. Visit every match rather than stopping at the first.
+ */
+
+/**
+ *  A walk follows every way its paths can still match at once. Each is a
+ *  suffix of one of the paths, to be matched at or below the value at hand;
+ *  a "..name" key keeps its suffix alive all the way down, next to the ones
+ *  it starts where it matches. The suffixes of every level of the walk are
+ *  kept on one stack, with their first keys and the paths they belong to,
+ *  so the input is read once however they overlap.
+ */
+
+struct walk_t {
+    paths_fn fn;
+    void *data;
+
+    const char **paths;
+    struct key_t *keys;
+    int *which;
+    long used;
+    long size;
+
+    /**
+     *  Name of an object member that did not fit in the buffer, as far as
+     *  any key could match it.
+     */
+
+    struct arena_t name;
+
+    /**
+     *  A match with suffixes still alive inside it, or one matched by more
+     *  than one path, is handed over once the walk is through it, since the
+     *  matches inside come after it. Until then it is echoed into held, from
+     *  offset held_at of the stream. The matches to hand over are at the
+     *  offsets in starts (from held_at), its own first.
+     */
+
+    struct output_t echo;
+    struct arena_t held;
+    long held_at;
+    struct walk_held_t {
+        long at;
+        int which;
+    } *starts;
+    long count;
+    long room;
+};
+
+static int walk_level(struct walk_t *walk, struct json_stream_t *stream, long base);
+
+/**
+ *  Add a suffix of path number which to the level starting at top, unless
+ *  it is there already. Its first key is parsed, or copied from from if that
+ *  is not NULL.
+ */
+
+static int walk_push(struct walk_t *walk, long top, const char *path, const struct key_t *from, int which) {
+    const char **paths;
+    struct key_t *keys;
+    struct key_t key;
+    int *whiches;
+    long i;
+    int code;
+
+    for (i = top; i < walk->used; i++) {
+        if (walk->paths[i] == path && walk->which[i] == which) return OK;
+    }
+    if (from != NULL) key = *from;
+    else if (path[0] != '\0') {
+        code = get_key(path, &key);
+        if (code != OK) return code;
+    }
+    if (walk->used == walk->size) {
+        paths = (const char **)realloc(walk->paths, 2 * walk->size * sizeof(*paths));
+        if (paths == NULL) return OUT_OF_MEMORY;
+        walk->paths = paths;
+        keys = (struct key_t *)realloc(walk->keys, 2 * walk->size * sizeof(*keys));
+        if (keys == NULL) return OUT_OF_MEMORY;
+        walk->keys = keys;
+        whiches = (int *)realloc(walk->which, 2 * walk->size * sizeof(*whiches));
+        if (whiches == NULL) return OUT_OF_MEMORY;
+        walk->which = whiches;
+        walk->size *= 2;
+    }
+    if (path[0] != '\0') walk->keys[walk->used] = key;
+    walk->which[walk->used] = which;
+    walk->paths[walk->used++] = path;
+    return OK;
+}
+
+/**
+ *  Note a match of path number which at the stream position, to hand over
+ *  with the held one.
+ */
+
+static int walk_start(struct walk_t *walk, struct json_stream_t *stream, int which) {
+    struct walk_held_t *starts;
+    long room;
+
+    if (walk->count == walk->room) {
+        room = (walk->room > 0) ? 2 * walk->room : 16;
+        starts = (struct walk_held_t *)realloc(walk->starts, room * sizeof(*starts));
+        if (starts == NULL) return stream->code = OUT_OF_MEMORY;
+        walk->starts = starts;
+        walk->room = room;
+    }
+    walk->starts[walk->count].at = stream_offset(stream) - walk->held_at;
+    walk->starts[walk->count++].which = which;
+    return OK;
+}
+
+/**
+ *  With the stream at the opening quote of a member name, pass over the
+ *  name to its closing quote. The suffixes of the level starting at base
+ *  that go on into the member's value are added as the next level. Keys are
+ *  compared with the name as written, escapes and all, and none is longer
+ *  than longest.
+ */
+
+static int walk_name(struct walk_t *walk, struct json_stream_t *stream, long base, size_t longest) {
+    struct key_t *key;
+    const char *name;
+    const char *end;
+    size_t len;
+    long top = walk->used;
+    long i;
+    int code;
+
+    if (bump(stream, NULL) != OK) return stream->code;
+
+    end = strpbrk(stream->pos, "\"\\");
+    if (end != NULL && end[0] == '"') {
+        // All in the buffer. Compare it there.
+        name = stream->pos;
+        len = end - name;
+        if (end > stream->pos) {
+            stream->prev_char = end[-1];
+            stream->pos = end;
+        }
+    }
+    else {
+        reset_arena(&walk->name);
+        while (stream->pos[0] != '"' && walk->name.used <= longest) {
+            if (stream->pos[0] == '\\') {
+                if (arena_append(&walk->name, stream->pos, 1) != OK) return stream->code = OUT_OF_MEMORY;
+                if (bump(stream, NULL) != OK) return stream->code;
+            }
+            if (arena_append(&walk->name, stream->pos, 1) != OK) return stream->code = OUT_OF_MEMORY;
+            if (bump(stream, NULL) != OK) return stream->code;
+        }
+        // Too long to match. Pass over the rest.
+        if (stream->pos[0] != '"' && string_body(stream, NULL) != OK) return stream->code;
+        name = walk->name.data;
+        len = walk->name.used;
+    }
+
+    for (i = base; i < top; i++) {
+        if (walk->paths[i][0] == '\0') continue;
+        key = &walk->keys[i];
+        if (key->type == ARRAY_INDEX || key->type == ARRAY_WILDCARD) continue;
+
+        if (key->type == RECURSIVE_NAME) {
+            code = walk_push(walk, top, walk->paths[i], key, walk->which[i]);
+            if (code != OK) return stream->code = code;
+            // The push may have moved the stack.
+            key = &walk->keys[i];
+        }
+        if (key->len == len && (len == 0 || memcmp(key->value, name, len) == 0)) {
+            code = walk_push(walk, top, key->next, NULL, walk->which[i]);
+            if (code != OK) return stream->code = code;
+        }
+    }
+    return OK;
+}
+
+/**
+ *  Walk the members of the object at the stream position.
+ */
+
+static int walk_members(struct walk_t *walk, struct json_stream_t *stream, long base) {
+    struct key_t *key;
+    size_t longest = 0;
+    long top = walk->used;
+    long names = 0;
+    long i;
+    int code;
+
+    for (i = base; i < top; i++) {
+        if (walk->paths[i][0] == '\0') continue;
+        key = &walk->keys[i];
+        if (key->type == ARRAY_INDEX || key->type == ARRAY_WILDCARD) continue;
+        if (key->len > longest) longest = key->len;
+        names++;
+    }
+
+    // An array index never matches an object key.
+    if (names == 0) return skip_collection(stream);
+
+    if (search(stream, "\"}", NULL) != OK) return stream->code;
+
+    while (stream->pos[0] != '}') {
+        code = walk_name(walk, stream, base, longest);
+        if (code == OK && search(stream, VALUE_TIPS, NULL) != OK) code = stream->code;
+        if (code == OK && walk->used > top) code = walk_level(walk, stream, top);
+        // No key match. Fast-forward to the next sibling.
+        else if (code == OK) code = fast_forward(stream, 1, 1, NULL, NULL);
+        walk->used = top;
+        if (code != OK) return code;
+
+        if (stream->pos[0] != '}') {
+            if (search(stream, "\"}", NULL) != OK) return stream->code;
+        }
+    }
+
+    return bump(stream, NULL);
+}
+
+/**
+ *  Walk the elements of the array at the stream position.
+ */
+
+static int walk_elements(struct walk_t *walk, struct json_stream_t *stream, long base) {
+    struct key_t *key;
+    struct key_t *only = NULL;
+    long top = walk->used;
+    long looks = 0;
+    long index;
+    long at;
+    long i;
+    int code;
+
+    for (i = base; i < top; i++) {
+        if (walk->paths[i][0] == '\0') continue;
+        key = &walk->keys[i];
+        if (key->type == NAME || key->type == BRACKETED_NAME) continue;
+        if (key->type == ARRAY_INDEX) {
+            index = strtol(key->value, NULL, 10);
+            if ((index == 0L && key->value[0] != '0') || index < 0) {
+                return stream->code = ARRAY_INDEX_ERROR;
+            }
+        }
+        only = key;
+        looks++;
+    }
+
+    if (looks == 0) return skip_collection(stream);
+
+    if (looks == 1 && only->type == ARRAY_INDEX) {
+        // Just the one element. Pass over the ones before it in bulk.
+        index = strtol(only->value, NULL, 10);
+        if (index > 0 && fast_forward(stream, 0, index, NULL, NULL) != OK) {
+            return stream->code;
+        }
+        if (stream->pos[0] != ']') {
+            if (search(stream, ELEMENT_TIPS, NULL) != OK) return stream->code;
+        }
+        if (stream->pos[0] != ']') {
+            code = walk_push(walk, top, only->next, NULL, walk->which[only - walk->keys]);
+            if (code == OK) code = walk_level(walk, stream, top);
+            walk->used = top;
+            if (code != OK) return stream->code = code;
+            if (fast_forward(stream, 1, -1, NULL, NULL) != OK) return stream->code;
+        }
+        return bump(stream, NULL);
+    }
+
+    if (search(stream, ELEMENT_TIPS, NULL) != OK) return stream->code;
+
+    for (at = 0; stream->pos[0] != ']'; at++) {
+        code = OK;
+        for (i = base; i < top && code == OK; i++) {
+            if (walk->paths[i][0] == '\0') continue;
+            key = &walk->keys[i];
+            if (key->type == RECURSIVE_NAME) {
+                code = walk_push(walk, top, walk->paths[i], key, walk->which[i]);
+            }
+            else if (key->type == ARRAY_WILDCARD ||
+                    (key->type == ARRAY_INDEX && strtol(key->value, NULL, 10) == at)) {
+                code = walk_push(walk, top, key->next, NULL, walk->which[i]);
+            }
+        }
+
+        if (code == OK && walk->used > top) code = walk_level(walk, stream, top);
+        else if (code == OK) code = fast_forward(stream, 1, 1, NULL, NULL);
+        walk->used = top;
+        if (code != OK) return stream->code = code;
+
+        if (stream->pos[0] != ']') {
+            if (search(stream, ELEMENT_TIPS, NULL) != OK) return stream->code;
+        }
+    }
+
+    return bump(stream, NULL);
+}
+
+/**
+ *  Walk the value at the stream position for the suffixes of the level
+ *  starting at base.
+ */
+
+static int walk_level(struct walk_t *walk, struct json_stream_t *stream, long base) {
+    struct json_stream_t copy;
+    const char *end;
+    long matched = 0;
+    long alive = 0;
+    long only = 0;
+    long i;
+    int deeper;
+    int holding = 0;
+    int handed;
+    int code;
+
+    for (i = base; i < walk->used; i++) {
+        if (walk->paths[i][0] != '\0') alive++;
+        else if (matched++ == 0) only = i;
+    }
+    deeper = alive > 0 && (stream->pos[0] == '{' || stream->pos[0] == '[');
+
+    if (matched && stream->echo == &walk->echo) {
+        // Inside a held match. This one goes with it.
+        for (i = base; i < walk->used; i++) {
+            if (walk->paths[i][0] != '\0') continue;
+            if (walk_start(walk, stream, walk->which[i]) != OK) return stream->code;
+        }
+        if (!deeper) return skip_value(stream);
+    }
+    else if (matched == 1 && !deeper) {
+        return walk->fn(stream, walk->which[only], walk->data);
+    }
+    else if (matched) {
+        reset_arena(&walk->held);
+        walk->count = 0;
+        walk->held_at = stream_offset(stream);
+        for (i = base; i < walk->used; i++) {
+            if (walk->paths[i][0] != '\0') continue;
+            if (walk_start(walk, stream, walk->which[i]) != OK) return stream->code;
+        }
+        stream->echo = &walk->echo;
+        stream->echo_pos = stream->pos;
+        holding = 1;
+    }
+
+    switch (stream->pos[0]) {
+        case '{': code = walk_members(walk, stream, base); break;
+        case '[': code = walk_elements(walk, stream, base); break;
+        default: code = skip_value(stream);
+    }
+    if (!holding) return code;
+
+    // Through the held match. Hand it over, then the matches inside it.
+    stream->echo = NULL;
+    if (code != OK && code != END_OF_STREAM) return code;
+    end = (code == OK) ? stream->pos : stream->pos + strlen(stream->pos);
+    if (capture(stream->echo_pos, end - stream->echo_pos, &walk->echo) != OK) {
+        return stream->code = OUT_OF_MEMORY;
+    }
+    for (i = 0; i < walk->count; i++) {
+        init_stream_string(&copy, walk->held.data + walk->starts[i].at);
+        handed = walk->fn(&copy, walk->starts[i].which, walk->data);
+        // The last of them may end the copy.
+        if (handed != OK && handed != END_OF_STREAM) return handed;
+    }
+    return code;
+}
+
+int walk_paths(struct json_stream_t *stream, const char **paths, int count, paths_fn fn, void *data) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Walking paths\n");
+#endif
+    struct walk_t walk;
+    int code = OK;
+    int i;
+
+    walk.fn = fn;
+    walk.data = data;
+    walk.size = 16;
+    walk.used = 0;
+    walk.paths = (const char **)malloc(walk.size * sizeof(*walk.paths));
+    walk.keys = (struct key_t *)malloc(walk.size * sizeof(*walk.keys));
+    walk.which = (int *)malloc(walk.size * sizeof(*walk.which));
+    init_arena(&walk.name);
+    init_arena(&walk.held);
+    init_arena_output(&walk.echo, &walk.held);
+    walk.starts = NULL;
+    walk.count = 0;
+    walk.room = 0;
+
+    if (walk.paths == NULL || walk.keys == NULL || walk.which == NULL) code = OUT_OF_MEMORY;
+    for (i = 0; i < count && code == OK; i++) {
+        code = walk_push(&walk, 0, paths[i], NULL, i);
+    }
+    if (code == OK) code = walk_level(&walk, stream, 0);
+    else stream->code = code;
+
+    free(walk.paths);
+    free(walk.keys);
+    free(walk.which);
+    free(walk.starts);
+    free_arena(&walk.name);
+    free_arena(&walk.held);
+    return code;
+}
+
+/**
+ *  The callback of a one-path walk, and its data.
+ */
+
+struct walk_one_t {
+    match_fn fn;
+    void *data;
+};
+
+static int walk_one(struct json_stream_t *stream, int which, void *data) {
+    struct walk_one_t *one = (struct walk_one_t *)data;
+
+    (void)which;
+    return one->fn(stream, one->data);
+}
+
+int walk_value(struct json_stream_t *stream, const char *path, match_fn fn, void *data) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Walking value\n");
+#endif
+    struct walk_one_t one;
+
+    one.fn = fn;
+    one.data = data;
+    return walk_paths(stream, &path, 1, walk_one, &one);
+}
+
+int walk_object(struct json_stream_t *stream, const char *path, match_fn fn, void *data) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Walking object\n");
+#endif
+    return walk_value(stream, path, fn, data);
+}
+
+int walk_array(struct json_stream_t *stream, const char *path, match_fn fn, void *data) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Walking array\n");
+#endif
+    return walk_value(stream, path, fn, data);
+}
+
+/**
+ *  Pipe functions. Traverse values while capturing their contents.
+ */
+
+int pipe_collection(struct json_stream_t *stream, struct output_t *out) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Piping collection\n");
+#endif
+    int code;
+
+    if (out == NULL || out->indent == JVRAW) {
+        return traverse_collection(stream, stream->pos[0], 1, out);
+    }
+
+    out->format.active = 1;
+    out->format.scan.in_string = 0;
+    out->format.scan.escaped = 0;
+    out->format.depth = 0;
+    out->format.fresh = 0;
+    code = traverse_collection(stream, stream->pos[0], 1, out);
+    out->format.active = 0;
+    return code;
+}
+
+int pipe_string(struct json_stream_t *stream, struct output_t *out) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Piping string\n");
+#endif
+    // Avoid capturing opening quote. Bump to first char. Check it b/c
+    // search won't include it.
+    if (bump(stream, NULL) != OK) return stream->code;
+    if (string_body(stream, out) != OK) return stream->code;
+    return bump(stream, NULL);
+}
+
+int pipe_number(struct json_stream_t *stream, struct output_t *out) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Piping number\n");
+#endif
+    return traverse_number(stream, out);
+}
+
+/**
+ *  Pass over the number at the stream position, pointing *chars at its len
+ *  characters. A number that lies whole in the buffer is pointed to there;
+ *  one cut by the end of the buffer is gathered into arena, however long.
+ *  Either way the characters are followed by one that cannot continue them.
+ */
+
+static int number_chars(struct json_stream_t *stream, struct arena_t *arena, const char **chars, size_t *len) {
+    struct output_t out;
+    int code;
+
+    *len = strspn(stream->pos, "0123456789+-.eE");
+    if (stream->pos[*len] != '\0') {
+        // Whole in the buffer, and followed by something else.
+        *chars = stream->pos;
+        stream->prev_char = stream->pos[*len - 1];
+        stream->pos += *len;
+        return OK;
+    }
+
+    reset_arena(arena);
+    init_arena_output(&out, arena);
+    code = pipe_number(stream, &out);
+    *chars = (arena->data != NULL) ? arena->data : "";
+    *len = arena->used;
+    return code;
+}
+
+int pipe_null(struct json_stream_t *stream, struct output_t *out) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Piping null\n");
+#endif
+    return traverse_null(stream, out);
+}
+
+int pipe_boolean(struct json_stream_t *stream, struct output_t *out) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Piping boolean\n");
+#endif
+    return traverse_boolean(stream, out);
+}
+
+int pipe_value(struct json_stream_t *stream, struct output_t *out) {
+    if (out != NULL && out->encoding != ENCODE_JSON) return encode_value(stream, out);
+
+    switch (stream->pos[0]) {
         case '{':
         case '[': return pipe_collection(stream, out);
         case '"': return pipe_string(stream, out);
@@ -579,6 +1850,1380 @@ int pipe_value(struct json_stream_t *stream, struct output_t *out) {
         case '8':
         case '9': return pipe_number(stream, out);
         case 'n': return pipe_null(stream, out);
+        case 't':
+        case 'f': return pipe_boolean(stream, out);
         default: return stream->code = NOT_AT_VALUE;
     }
 }
+
+
+int pipe_json(struct json_stream_t *stream, struct output_t *out) {
+    if (stream->pos[0] == '"') return traverse_string(stream, out);
+    return pipe_value(stream, out);
+}
+
+
+/**
+ *  Value of the four hex digits at chars, or -1.
+ */
+
+static long hex4(const char *chars) {
+    long value = 0;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        value <<= 4;
+        if (chars[i] >= '0' && chars[i] <= '9') value |= chars[i] - '0';
+        else if (chars[i] >= 'a' && chars[i] <= 'f') value |= chars[i] - 'a' + 10;
+        else if (chars[i] >= 'A' && chars[i] <= 'F') value |= chars[i] - 'A' + 10;
+        else return -1;
+    }
+    return value;
+}
+
+int unescape_string(const char *chars, size_t len, struct output_t *out) {
+    const char *end = chars + len;
+    const char *chp;
+    char utf8[4];
+    long code;
+    long low;
+    int n;
+
+    while (chars < end) {
+        // Copy up to the next escape in one go.
+        chp = (const char *)memchr(chars, '\\', end - chars);
+        if (chp == NULL) chp = end;
+        if (capture(chars, chp - chars, out) != OK) return STREAM_WRITE_ERROR;
+        chars = chp;
+        if (chars == end) break;
+
+        if (end - chars < 2) return capture(chars, end - chars, out);
+        n = 2;
+        switch (chars[1]) {
+            case 'b': utf8[0] = '\b'; break;
+            case 'f': utf8[0] = '\f'; break;
+            case 'n': utf8[0] = '\n'; break;
+            case 'r': utf8[0] = '\r'; break;
+            case 't': utf8[0] = '\t'; break;
+            case 'u': n = 0; break;
+            default: utf8[0] = chars[1];
+        }
+        if (n == 2) {
+            if (capture(utf8, 1, out) != OK) return STREAM_WRITE_ERROR;
+            chars += 2;
+            continue;
+        }
+
+        code = (end - chars >= 6) ? hex4(chars + 2) : -1;
+        if (code < 0) {
+            if (capture(chars, 2, out) != OK) return STREAM_WRITE_ERROR;
+            chars += 2;
+            continue;
+        }
+        chars += 6;
+        if (code >= 0xD800 && code <= 0xDBFF && end - chars >= 6 &&
+                chars[0] == '\\' && chars[1] == 'u') {
+            low = hex4(chars + 2);
+            if (low >= 0xDC00 && low <= 0xDFFF) {
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                chars += 6;
+            }
+        }
+
+        if (code < 0x80) {
+            utf8[0] = (char)code;
+            n = 1;
+        }
+        else if (code < 0x800) {
+            utf8[0] = (char)(0xC0 | (code >> 6));
+            utf8[1] = (char)(0x80 | (code & 0x3F));
+            n = 2;
+        }
+        else if (code < 0x10000) {
+            utf8[0] = (char)(0xE0 | (code >> 12));
+            utf8[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+            utf8[2] = (char)(0x80 | (code & 0x3F));
+            n = 3;
+        }
+        else {
+            utf8[0] = (char)(0xF0 | (code >> 18));
+            utf8[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+            utf8[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+            utf8[3] = (char)(0x80 | (code & 0x3F));
+            n = 4;
+        }
+        if (capture(utf8, n, out) != OK) return STREAM_WRITE_ERROR;
+    }
+    return OK;
+}
+
+
+/**
+ *  Encode functions. Transcode values to CBOR or MessagePack.
+ */
+
+struct encoder_t {
+    enum encoding_t encoding;
+
+    /**
+     *  Encoded bytes are held here on their way to out, until a buffer's
+     *  worth has gathered. In MessagePack from input that cannot be read
+     *  twice, until the value is done (up to JVHOLD bytes).
+     */
+
+    struct output_t *out;
+    struct output_t held_out;
+    struct arena_t held;
+
+    /**
+     *  Whether the input can be read twice, so that MessagePack counts can
+     *  be taken before the members are written.
+     */
+
+    int rewind;
+
+    /**
+     *  The current string (or number split across buffers) as read, and
+     *  the string decoded.
+     */
+
+    struct arena_t raw;
+    struct arena_t text;
+};
+
+/**
+ *  Write a head of n bytes: the lead byte, then value big-endian in the
+ *  n - 1 bytes after it.
+ */
+
+static int encode_head(struct encoder_t *enc, int lead, uint64_t value, int n) {
+    char bytes[9];
+    int i;
+
+    bytes[0] = (char)lead;
+    for (i = n - 1; i > 0; i--) {
+        bytes[i] = (char)(value & 0xFF);
+        value >>= 8;
+    }
+    return capture(bytes, n, &enc->held_out);
+}
+
+/**
+ *  A CBOR head: major type and argument, in as few bytes as will do.
+ */
+
+static int cbor_head(struct encoder_t *enc, int major, uint64_t value) {
+    major <<= 5;
+    if (value < 24) return encode_head(enc, major | (int)value, 0, 1);
+    if (value < 0x100) return encode_head(enc, major | 24, value, 2);
+    if (value < 0x10000) return encode_head(enc, major | 25, value, 3);
+    if (value < 0x100000000ULL) return encode_head(enc, major | 26, value, 5);
+    return encode_head(enc, major | 27, value, 9);
+}
+
+/**
+ *  An integer, given as its sign and magnitude: uint64 if it is not
+ *  negative, int64 if it is.
+ */
+
+static int encode_int(struct encoder_t *enc, int negative, uint64_t magnitude) {
+    int64_t value = (int64_t)(0 - magnitude);
+
+    if (enc->encoding == ENCODE_CBOR) {
+        if (!negative) return cbor_head(enc, 0, magnitude);
+        return cbor_head(enc, 1, magnitude - 1);
+    }
+    if (!negative) {
+        if (magnitude < 0x80) return encode_head(enc, (int)magnitude, 0, 1);
+        if (magnitude < 0x100) return encode_head(enc, 0xCC, magnitude, 2);
+        if (magnitude < 0x10000) return encode_head(enc, 0xCD, magnitude, 3);
+        if (magnitude < 0x100000000ULL) return encode_head(enc, 0xCE, magnitude, 5);
+        return encode_head(enc, 0xCF, magnitude, 9);
+    }
+    if (value >= -32) return encode_head(enc, (int)(value & 0xFF), 0, 1);
+    if (value >= -0x80) return encode_head(enc, 0xD0, (uint64_t)value, 2);
+    if (value >= -0x8000) return encode_head(enc, 0xD1, (uint64_t)value, 3);
+    if (value >= -0x80000000LL) return encode_head(enc, 0xD2, (uint64_t)value, 5);
+    return encode_head(enc, 0xD3, (uint64_t)value, 9);
+}
+
+/**
+ *  Parse digits as an integer that fits a uint64, or an int64 if it is
+ *  negative. Returns 0 if they are not a plain integer, do not fit, or are
+ *  -0 (which only a float keeps).
+ */
+
+static int parse_int(const char *digits, size_t len, int *negative, uint64_t *magnitude) {
+    const char *chp = digits + (digits[0] == '-');
+    const char *end = digits + len;
+    uint64_t limit = (digits[0] == '-') ? (uint64_t)INT64_MAX + 1 : UINT64_MAX;
+    uint64_t n = 0;
+
+    if (chp == end) return 0;
+    for (; chp < end; chp++) {
+        if (*chp < '0' || *chp > '9') return 0;
+        if (n > (limit - (*chp - '0')) / 10) return 0;
+        n = n * 10 + (*chp - '0');
+    }
+    *negative = (digits[0] == '-');
+    *magnitude = n;
+    return !(*negative && n == 0);
+}
+
+static int encode_number(struct encoder_t *enc, struct json_stream_t *stream) {
+    const char *chp;
+    size_t len;
+    uint64_t magnitude;
+    uint64_t bits;
+    double value;
+    int negative;
+    int code;
+    int wrote;
+
+    code = number_chars(stream, &enc->raw, &chp, &len);
+    if (code != OK && code != END_OF_STREAM) return code;
+
+    if (parse_int(chp, len, &negative, &magnitude)) {
+        wrote = encode_int(enc, negative, magnitude);
+    }
+    else {
+        value = strtod(chp, NULL);
+        memcpy(&bits, &value, sizeof(bits));
+        wrote = encode_head(enc, (enc->encoding == ENCODE_CBOR) ? 0xFB : 0xCB, bits, 9);
+    }
+    if (wrote != OK) return stream->code = STREAM_WRITE_ERROR;
+    return code;
+}
+
+static int encode_string(struct encoder_t *enc, struct json_stream_t *stream) {
+    struct output_t out;
+    struct arena_t *text = &enc->raw;
+    size_t len;
+    int code;
+    int end;
+
+    reset_arena(&enc->raw);
+    init_arena_output(&out, &enc->raw);
+    if (bump(stream, NULL) != OK) return stream->code;
+    if (string_body(stream, &out) != OK) return stream->code;
+    end = bump(stream, NULL);
+    if (end != OK && end != END_OF_STREAM) return end;
+
+    if (enc->raw.used > 0 && memchr(enc->raw.data, '\\', enc->raw.used) != NULL) {
+        reset_arena(&enc->text);
+        init_arena_output(&out, &enc->text);
+        if (unescape_string(enc->raw.data, enc->raw.used, &out) != OK) return stream->code = OUT_OF_MEMORY;
+        text = &enc->text;
+    }
+
+    len = text->used;
+    if (enc->encoding == ENCODE_CBOR) code = cbor_head(enc, 3, len);
+    else if (len < 32) code = encode_head(enc, 0xA0 | (int)len, 0, 1);
+    else if (len < 0x100) code = encode_head(enc, 0xD9, len, 2);
+    else if (len < 0x10000) code = encode_head(enc, 0xDA, len, 3);
+    else code = encode_head(enc, 0xDB, len, 5);
+    if (code != OK || capture(text->data, len, &enc->held_out) != OK) return stream->code = STREAM_WRITE_ERROR;
+    return end;
+}
+
+static int encode_member(struct encoder_t *enc, struct json_stream_t *stream);
+
+/**
+ *  Count the members of the collection at the stream position, then go
+ *  back to it: within the buffer if the count did not leave it, otherwise
+ *  by seeking.
+ */
+
+static int encode_count(struct json_stream_t *stream, long *count) {
+    const char *pos = stream->pos;
+    long offset = stream->offset;
+    long at = stream_offset(stream);
+    char prev = stream->prev_char;
+    int code;
+
+    code = count_members(stream, count);
+    if (code != OK && code != END_OF_STREAM) return code;
+    if (stream->offset == offset) {
+        stream->pos = pos;
+        stream->prev_char = prev;
+        return stream->code = OK;
+    }
+    return seek_stream(stream, at);
+}
+
+/**
+ *  Objects and arrays. In MessagePack the count comes first: it is taken
+ *  in a pass over the members before they are written, or, if the input
+ *  cannot be read twice, goes in a placeholder that is patched once they
+ *  are held.
+ */
+
+static int encode_collection(struct encoder_t *enc, struct json_stream_t *stream) {
+    char open = stream->pos[0];
+    char close = (open == '{') ? '}' : ']';
+    const char *tips = (open == '{') ? "\"}" : ELEMENT_TIPS;
+    size_t at = enc->held.used;
+    uint64_t count = 0;
+    long members = 0;
+    int i;
+
+    if (enc->encoding == ENCODE_CBOR) {
+        if (encode_head(enc, (open == '{') ? 0xBF : 0x9F, 0, 1) != OK) return stream->code = STREAM_WRITE_ERROR;
+    }
+    else {
+        if (enc->rewind && encode_count(stream, &members) != OK) return stream->code;
+        if (encode_head(enc, (open == '{') ? 0xDF : 0xDD, (uint64_t)members, 5) != OK) {
+            return stream->code = OUT_OF_MEMORY;
+        }
+    }
+
+    if (search(stream, tips, NULL) != OK) return stream->code;
+    while (stream->pos[0] != close) {
+        if (open == '{') {
+            if (encode_string(enc, stream) != OK) return stream->code;
+            if (search(stream, VALUE_TIPS, NULL) != OK) return stream->code;
+        }
+        if (encode_member(enc, stream) != OK) return stream->code;
+        count++;
+        if ((enc->encoding == ENCODE_CBOR || enc->rewind) && enc->held.used >= JVBUF) {
+            if (capture(enc->held.data, enc->held.used, enc->out) != OK) return stream->code = STREAM_WRITE_ERROR;
+            reset_arena(&enc->held);
+        }
+        else if (enc->held.used > JVHOLD) {
+            return stream->code = OUT_OF_MEMORY;
+        }
+        if (stream->pos[0] != close) {
+            if (search(stream, tips, NULL) != OK) return stream->code;
+        }
+    }
+
+    if (enc->encoding == ENCODE_CBOR) {
+        if (encode_head(enc, 0xFF, 0, 1) != OK) return stream->code = STREAM_WRITE_ERROR;
+    }
+    else if (!enc->rewind) {
+        for (i = 4; i > 0; i--) {
+            enc->held.data[at + i] = (char)(count & 0xFF);
+            count >>= 8;
+        }
+    }
+    return bump(stream, NULL);
+}
+
+/**
+ *  Encode the value at the stream position and leave the stream just past
+ *  it.
+ */
+
+static int encode_member(struct encoder_t *enc, struct json_stream_t *stream) {
+    int cbor = (enc->encoding == ENCODE_CBOR);
+    int lead;
+
+    switch (stream->pos[0]) {
+        case '{':
+        case '[': return encode_collection(enc, stream);
+        case '"': return encode_string(enc, stream);
+        case 'n': lead = cbor ? 0xF6 : 0xC0; break;
+        case 't': lead = cbor ? 0xF5 : 0xC3; break;
+        case 'f': lead = cbor ? 0xF4 : 0xC2; break;
+        default:
+            if (stream->pos[0] != '-' && (stream->pos[0] < '0' || stream->pos[0] > '9')) {
+                return stream->code = NOT_AT_VALUE;
+            }
+            return encode_number(enc, stream);
+    }
+    if (encode_head(enc, lead, 0, 1) != OK) return stream->code = STREAM_WRITE_ERROR;
+    return (stream->pos[0] == 'n') ? skip_null(stream) : skip_boolean(stream);
+}
+
+int encode_value(struct json_stream_t *stream, struct output_t *out) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Encoding value\n");
+#endif
+    struct encoder_t enc;
+    int code;
+
+    enc.encoding = out->encoding;
+    enc.out = out;
+    enc.rewind = (stream->echo == NULL && (stream->src == NULL || ftell(stream->src) >= 0));
+    init_arena(&enc.held);
+    init_arena(&enc.raw);
+    init_arena(&enc.text);
+    init_arena_output(&enc.held_out, &enc.held);
+
+    // END_OF_STREAM right after the value is fine; the value is whole.
+    code = encode_member(&enc, stream);
+    if (code == OK || code == END_OF_STREAM || enc.encoding == ENCODE_CBOR || enc.rewind) {
+        if (capture(enc.held.data, enc.held.used, out) != OK) code = STREAM_WRITE_ERROR;
+    }
+
+    free_arena(&enc.held);
+    free_arena(&enc.raw);
+    free_arena(&enc.text);
+    return stream->code = code;
+}
+
+
+int pipe_range(struct json_stream_t *stream, long start, long end, struct output_t *out) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Piping range [%ld, %ld)\n", start, end);
+#endif
+    char chunk[JVBUF];
+    size_t count;
+    size_t len;
+    long saved;
+    int code;
+#ifdef __linux__
+    off_t off;
+    ssize_t sent;
+
+    if (out != NULL && out->fp != NULL && out->mem == NULL && start < end) {
+        // Anything already buffered by stdio must land first.
+        if (fflush(out->fp) != 0) return stream->code = STREAM_WRITE_ERROR;
+        off = start;
+        while (off < end) {
+            sent = sendfile(fileno(out->fp), fileno(stream->src), &off, end - off);
+            if (sent <= 0) break;
+        }
+        // Whatever the kernel refused gets copied below.
+        start = off;
+    }
+#endif
+
+    if (out == NULL || start >= end) return OK;
+
+    saved = ftell(stream->src);
+    if (saved < 0 || fseek(stream->src, start, SEEK_SET) != 0) {
+        return stream->code = STREAM_READ_ERROR;
+    }
+
+    code = OK;
+    while (start < end) {
+        len = (end - start < JVBUF) ? (size_t)(end - start) : JVBUF;
+        count = fread(chunk, JVBYTE, len, stream->src);
+        if (count == 0) break;
+        code = capture(chunk, count, out);
+        if (code != OK) break;
+        start += count;
+    }
+
+    // Put the source back where the stream left it.
+    if (fseek(stream->src, saved, SEEK_SET) != 0) {
+        return stream->code = STREAM_READ_ERROR;
+    }
+    if (code != OK) return stream->code = code;
+    return OK;
+}
+
+int transfer_value(struct json_stream_t *stream, struct output_t *out) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Transferring value\n");
+#endif
+    long start;
+    long end;
+    int code;
+    char ch = stream->pos[0];
+
+    if ((ch != '{' && ch != '[' && ch != '"') || stream->src == NULL ||
+            (ch != '"' && out != NULL && out->indent != JVRAW) ||
+            (out != NULL && out->encoding != ENCODE_JSON) ||
+            ftell(stream->src) < 0) {
+        return pipe_value(stream, out);
+    }
+
+    // Strings are piped without their quotes.
+    start = stream_offset(stream) + (ch == '"');
+    code = skip_value(stream);
+    if (code == OK) {
+        end = stream_offset(stream) - (ch == '"');
+    }
+    else if (code == END_OF_STREAM) {
+        // The source ended at the stream position. Pipe what there is
+        // (less a final closing quote), then report.
+        end = stream->offset + strlen(stream->buffer);
+        if (ch == '"' && stream->pos[0] == '"' && stream_offset(stream) >= start) end--;
+    }
+    else return code;
+
+    if (pipe_range(stream, start, end, out) != OK) return stream->code;
+    return stream->code = code;
+}
+
+int slice_value(struct json_stream_t *stream, struct output_t *out) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Slicing value\n");
+#endif
+    struct output_t raw;
+    const char *start = stream->pos;
+    const char *end;
+    long offset = stream->offset;
+    size_t used = 0;
+    int quoted = (stream->pos[0] == '"');
+    int code;
+
+    out->slice = NULL;
+    out->slice_len = 0;
+
+    if (stream->echo != NULL || (stream->src != NULL && out->arena == NULL)) {
+        return pipe_value(stream, out);
+    }
+
+    // Skip the value. Should the buffer be reloaded on the way, what it
+    // held is echoed to the arena first.
+    if (stream->src != NULL) {
+        used = out->arena->used;
+        init_arena_output(&raw, out->arena);
+        stream->echo = &raw;
+        stream->echo_pos = start;
+    }
+    code = skip_value(stream);
+    stream->echo = NULL;
+    if (code != OK && code != END_OF_STREAM) return code;
+
+    // Past the value, or at the end of the input.
+    end = (code == OK) ? stream->pos : stream->pos + strlen(stream->pos);
+
+    if (stream->offset != offset) {
+        // Not in one buffer. The arena has the rest of it but for this.
+        if (capture(stream->echo_pos, end - stream->echo_pos, &raw) != OK) return OUT_OF_MEMORY;
+        start = out->arena->data + used;
+        end = out->arena->data + out->arena->used;
+    }
+    else if (stream->src != NULL && out->arena->used > used) {
+        // Echoed by a read that found the end of the input. Not needed.
+        out->arena->used = used;
+        out->arena->data[used] = '\0';
+    }
+
+    if (quoted) {
+        start++;
+        if (end > start && end[-1] == '"' && (code == OK || stream->pos[0] == '"')) end--;
+    }
+    out->slice = start;
+    out->slice_len = end - start;
+    return stream->code = code;
+}
+
+
+/**
+ *  Edit functions. Copy a stream while changing it.
+ */
+
+/**
+ *  Echo the stream up to (not including) end.
+ */
+
+static int echo_to(struct json_stream_t *stream, const char *end) {
+    if (capture(stream->echo_pos, end - stream->echo_pos, stream->echo) != OK) {
+        return stream->code = STREAM_WRITE_ERROR;
+    }
+    stream->echo_pos = end;
+    return OK;
+}
+
+/**
+ *  Send the echo somewhere else from the current position on, dropping
+ *  anything not yet echoed.
+ */
+
+static void echo_from(struct json_stream_t *stream, struct output_t *out) {
+    stream->echo = out;
+    stream->echo_pos = stream->pos;
+}
+
+/**
+ *  Pass over whitespace, to the next of the given characters.
+ */
+
+static int skip_space(struct json_stream_t *stream, const char *chars) {
+    switch (stream->pos[0]) {
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n': return search(stream, chars, NULL);
+        default: return OK;
+    }
+}
+
+/**
+ *  Echo everything left in the stream.
+ */
+
+static int echo_rest(struct json_stream_t *stream) {
+    struct output_t *out = stream->echo;
+    long start;
+    long end;
+    int code;
+
+    if (stream->src != NULL) {
+        // Finish the buffer, then let pipe_range() move the rest.
+        if (echo_to(stream, stream->buffer + strlen(stream->buffer)) != OK) return stream->code;
+        start = ftell(stream->src);
+        if (start >= 0 && fseek(stream->src, 0, SEEK_END) == 0 && (end = ftell(stream->src)) >= 0) {
+            if (fseek(stream->src, start, SEEK_SET) != 0) return stream->code = STREAM_READ_ERROR;
+            if (pipe_range(stream, start, end, out) != OK) return stream->code;
+            return OK;
+        }
+        clearerr(stream->src);
+    }
+
+    while ((code = read(stream)) == OK);
+    if (code != END_OF_STREAM) return code;
+    return echo_to(stream, stream->pos + strlen(stream->pos));
+}
+
+/**
+ *  With the stream at the object or array holding the value to edit, find
+ *  the member named by key and replace or delete it. The separator and key
+ *  in front of each member are held back until the member is known not to
+ *  match.
+ *
+ *  Returns OK if a member was edited, END_OF_STREAM if none matched, or an
+ *  error code. The stream is left where the copying can carry on.
+ */
+
+static int edit_member(struct json_stream_t *stream, const char *key, const char *json, struct output_t *out) {
+    struct key_t path_key;
+    struct arena_t hold;
+    struct output_t held;
+    const char *subpath;
+    char open = stream->pos[0];
+    char close = (open == '{') ? '}' : ']';
+    size_t lead;
+    long index = 0;
+    long i;
+    int code;
+
+    code = get_key(key, &path_key);
+    if (code != OK) return stream->code = code;
+    if (open != ((path_key.type == ARRAY_INDEX) ? '[' : '{')) return END_OF_STREAM;
+    if (path_key.type == ARRAY_INDEX) index = strtol(path_key.value, NULL, 10);
+
+    init_arena(&hold);
+    init_arena_output(&held, &hold);
+
+    // Members before the one we want cannot match. Copy them.
+    if (index > 0) {
+        if (fast_forward(stream, 0, index, NULL, NULL) != OK) goto done;
+        if (stream->pos[0] == close) {
+            free_arena(&hold);
+            return END_OF_STREAM;
+        }
+    }
+
+    for (i = index; ; i++) {
+        // Hold back the separator (there is none before the first member),
+        // whitespace, and the key.
+        if (echo_to(stream, stream->pos + (i == 0)) != OK) goto done;
+        reset_arena(&hold);
+        stream->echo = &held;
+        if (search(stream, (open == '{') ? "\"}" : ELEMENT_TIPS, NULL) != OK) goto done;
+        if (stream->pos[0] == close) break;
+        if (echo_to(stream, stream->pos) != OK) goto done;
+        lead = hold.used;
+
+        subpath = key;
+        if (open == '{') {
+            subpath = scan_key(stream, key);
+            if (subpath == NULL) goto done;
+            if (search(stream, VALUE_TIPS, NULL) != OK) goto done;
+        }
+
+        if (subpath != key || open == '[') {
+            // Found. Everything held up to here stays for a replacement,
+            // and goes with a deletion.
+            if (json != NULL) {
+                if (echo_to(stream, stream->pos) != OK) goto done;
+                if (capture(hold.data, hold.used, out) != OK) goto write_error;
+            }
+
+            stream->echo = NULL;
+            code = skip_value(stream);
+            if (code != OK && code != END_OF_STREAM) goto done;
+            if (json == NULL && i == 0 && code == OK) {
+                // First member: its trailing comma goes instead, and the
+                // whitespace before it stays for the next member.
+                if (skip_space(stream, (open == '{') ? ",}" : ",]") != OK) goto done;
+                if (stream->pos[0] == ',') {
+                    if (capture(hold.data, lead, out) != OK) goto write_error;
+                    if (bump(stream, NULL) != OK) goto done;
+                    if (skip_space(stream, (open == '{') ? "\"}" : ELEMENT_TIPS) != OK) goto done;
+                }
+            }
+            echo_from(stream, out);
+            if (code == END_OF_STREAM) stream->echo_pos += strlen(stream->pos);
+            if (json != NULL && capture(json, strlen(json), out) != OK) goto write_error;
+            free_arena(&hold);
+            return OK;
+        }
+
+        // Not this one. Let the held characters through and move on.
+        if (echo_to(stream, stream->pos) != OK) goto done;
+        if (capture(hold.data, hold.used, out) != OK) goto write_error;
+        reset_arena(&hold);
+        echo_from(stream, out);
+        if (fast_forward(stream, 1, 1, NULL, NULL) != OK) goto done;
+        if (stream->pos[0] == close) break;
+    }
+
+    // No match.
+    if (echo_to(stream, stream->pos) != OK) goto done;
+    if (capture(hold.data, hold.used, out) != OK) goto write_error;
+    echo_from(stream, out);
+    free_arena(&hold);
+    return END_OF_STREAM;
+
+write_error:
+    stream->code = STREAM_WRITE_ERROR;
+done:
+    free_arena(&hold);
+    return stream->code;
+}
+
+int edit_value(struct json_stream_t *stream, const char *path, const char *json, struct output_t *out) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Editing value at %s\n", path);
+#endif
+    struct key_t key;
+    const char *last = path;
+    const char *chp = path;
+    const char *subpath;
+    char *parent;
+    int code;
+
+    // Split off the last key; its parent is scanned for as usual.
+    do {
+        code = get_key(chp, &key);
+        if (code != OK) return stream->code = code;
+        last = chp;
+        chp = key.next;
+    } while (chp[0] != '\0');
+    if (key.type == RECURSIVE_NAME || key.type == ARRAY_WILDCARD) {
+        return stream->code = BAD_PATH_STRING;
+    }
+    if (key.type == ARRAY_INDEX && key.value[0] == '-') {
+        return stream->code = ARRAY_INDEX_ERROR;
+    }
+    if (path_walks(path) || tail_key(path) != NULL) {
+        return stream->code = BAD_PATH_STRING;
+    }
+
+    parent = (char *)malloc(last - path + 1);
+    if (parent == NULL) return stream->code = OUT_OF_MEMORY;
+    memcpy(parent, path, last - path);
+    parent[last - path] = '\0';
+
+    echo_from(stream, out);
+    if (skip_space(stream, VALUE_TIPS) != OK) subpath = NULL;
+    else subpath = scan_value(stream, parent);
+    if (subpath == NULL) code = stream->code;
+    else if (subpath[0] != '\0') code = END_OF_STREAM;
+    else code = edit_member(stream, last, json, out);
+    free(parent);
+    if (code != OK && code != END_OF_STREAM) {
+        stream->echo = NULL;
+        return code;
+    }
+
+    if (echo_rest(stream) != OK) code = stream->code;
+    stream->echo = NULL;
+    return code;
+}
+
+
+/**
+ *  Aggregate functions. Reduce values without capturing them.
+ */
+
+int count_members(struct json_stream_t *stream, long *count) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Counting members\n");
+#endif
+    char open = stream->pos[0];
+    long commas;
+
+    *count = 0;
+    if (open != '{' && open != '[') return stream->code = NOT_AT_VALUE;
+
+    // Empty, or at the first member?
+    if (search(stream, (open == '{') ? "\"}" : ELEMENT_TIPS, NULL) != OK) {
+        return stream->code;
+    }
+    if (stream->pos[0] == ((open == '{') ? '}' : ']')) return bump(stream, NULL);
+
+    // Members are one more than the commas at depth one.
+    if (fast_forward(stream, 1, -1, &commas, NULL) != OK) return stream->code;
+    *count = commas + 1;
+    return bump(stream, NULL);
+}
+
+int pipe_keys(struct json_stream_t *stream, struct output_t *out) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Piping keys\n");
+#endif
+    if (stream->pos[0] != '{') return stream->code = NOT_AT_VALUE;
+
+    if (search(stream, "\"}", NULL) != OK) return stream->code;
+    while (stream->pos[0] != '}') {
+        if (bump(stream, NULL) != OK) return stream->code;
+        if (string_body(stream, out) != OK) return stream->code;
+        if (capture("\n", 1, out) != OK) return stream->code = STREAM_WRITE_ERROR;
+
+        // Over the value, to the next key or the end.
+        if (search(stream, VALUE_TIPS, NULL) != OK) return stream->code;
+        if (fast_forward(stream, 1, 1, NULL, NULL) != OK) return stream->code;
+        if (stream->pos[0] != '}') {
+            if (search(stream, "\"}", NULL) != OK) return stream->code;
+        }
+    }
+
+    return bump(stream, NULL);
+}
+
+int read_number(struct json_stream_t *stream, double *value) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Reading number\n");
+#endif
+    struct arena_t digits;
+    const char *chars;
+    size_t len;
+    int code;
+
+    if (stream->pos[0] != '-' && (stream->pos[0] < '0' || stream->pos[0] > '9')) {
+        return stream->code = NOT_AT_VALUE;
+    }
+
+    init_arena(&digits);
+    code = number_chars(stream, &digits, &chars, &len);
+    if (code == OK || code == END_OF_STREAM) *value = strtod(chars, NULL);
+    free_arena(&digits);
+    return code;
+}
+
+
+/**
+ *  Diff functions. Two streams are walked in lockstep; see diff_value().
+ */
+
+/**
+ *  Where a raw comparison found the first difference: for each collection
+ *  open there, outermost first, its opening character, the offset in the
+ *  first stream of the last boundary at its level (the opening character or
+ *  the latest comma) and the index of the member or element after it.
+ */
+
+struct diff_level_t {
+    long at;
+    long index;
+    char open;
+};
+
+struct diff_t {
+    struct output_t *out;
+    struct arena_t path;
+    struct arena_t ka;
+    struct arena_t kb;
+    struct arena_t key;
+    long changes;
+
+    struct diff_level_t *levels;
+    long size;
+};
+
+/**
+ *  Compare two collections as raw bytes, 64 at a time, until the first one
+ *  closes. Block boundaries fall wherever either buffer runs out, and the
+ *  scan state carries over. Structural characters before the first
+ *  difference are followed into diff->levels, so that the comparison need
+ *  not be repeated to find where it is.
+ *
+ *  If the spans are equal, both streams are left just past them and *count
+ *  is 0. Otherwise *count is the number of levels filled in, and the streams
+ *  are somewhere inside.
+ */
+
+static int same_collection(struct diff_t *diff, struct json_stream_t *a, struct json_stream_t *b, long *count) {
+    struct scan_state_t state = {0, 0};
+    struct block_t block;
+    struct diff_level_t *levels;
+    const char *pa = a->pos;
+    const char *pb = b->pos;
+    size_t la = strlen(pa);
+    size_t lb = strlen(pb);
+    size_t n;
+    size_t end;
+    long depth = 0;
+    long at;
+    uint64_t bits;
+    uint64_t commas;
+    uint64_t run;
+    int i;
+    int ca;
+    int cb;
+
+    while (1) {
+        while (la > 0 && lb > 0) {
+            n = (la < lb) ? la : lb;
+            if (n > 64) n = 64;
+            classify_block(pa, n, &state, &block);
+
+            // Only what comes before the first difference counts.
+            end = n;
+            if (memcmp(pa, pb, n) != 0) {
+                for (end = 0; pa[end] == pb[end]; end++);
+            }
+            bits = block.open | block.close;
+            commas = block.comma;
+            if (end < 64) {
+                bits &= (1ULL << end) - 1;
+                commas &= (1ULL << end) - 1;
+            }
+
+            // Brackets one by one; the commas between two of them all
+            // belong to the same level.
+            at = a->offset + (pa - a->span);
+            while (1) {
+                i = bits ? JVCTZ(bits) : 64;
+                run = (i < 64) ? commas & ((1ULL << i) - 1) : commas;
+                if (run) {
+                    diff->levels[depth - 1].at = at + 63 - JVCLZ(run);
+                    diff->levels[depth - 1].index += JVPOPCOUNT(run);
+                    commas &= ~run;
+                }
+                if (!bits) break;
+                bits &= bits - 1;
+
+                if ((block.open >> i) & 1) {
+                    if (depth == diff->size) {
+                        diff->size = (diff->size > 0) ? diff->size * 2 : 16;
+                        levels = (struct diff_level_t *)realloc(diff->levels, diff->size * sizeof(*levels));
+                        if (levels == NULL) return OUT_OF_MEMORY;
+                        diff->levels = levels;
+                    }
+                    diff->levels[depth].at = at + i;
+                    diff->levels[depth].index = 0;
+                    diff->levels[depth].open = pa[i];
+                    depth++;
+                }
+                else {
+                    if (--depth > 0) continue;
+
+                    // Both on the closing character, then past it.
+                    a->pos = pa + i;
+                    b->pos = pb + i;
+                    if (a->pos > a->span) a->prev_char = a->pos[-1];
+                    if (b->pos > b->span) b->prev_char = b->pos[-1];
+                    *count = 0;
+                    ca = bump(a, NULL);
+                    cb = bump(b, NULL);
+                    return (ca != OK) ? ca : cb;
+                }
+            }
+
+            if (end < n) {
+                *count = depth;
+                return OK;
+            }
+            pa += n;
+            pb += n;
+            la -= n;
+            lb -= n;
+        }
+
+        if (la == 0) {
+            if (read(a) != OK) return a->code;
+            pa = a->pos;
+            la = strlen(pa);
+        }
+        if (lb == 0) {
+            if (read(b) != OK) return b->code;
+            pb = b->pos;
+            lb = strlen(pb);
+        }
+    }
+}
+
+/**
+ *  Append a key, as .key or ["key"], or an array index to the path.
+ */
+
+static int diff_push(struct diff_t *diff, const char *key, size_t len, long index) {
+    char digits[32];
+
+    if (key == NULL) {
+        sprintf(digits, "[%ld]", index);
+        return arena_append(&diff->path, digits, strlen(digits));
+    }
+    if (len > 0 && strcspn(key, ".[]\"\\ ") >= len) {
+        // No dot in front of a top-level key.
+        if (diff->path.used > 0 && arena_append(&diff->path, ".", 1) != OK) return OUT_OF_MEMORY;
+        return arena_append(&diff->path, key, len);
+    }
+    if (arena_append(&diff->path, "[\"", 2) != OK) return OUT_OF_MEMORY;
+    if (arena_append(&diff->path, key, len) != OK) return OUT_OF_MEMORY;
+    return arena_append(&diff->path, "\"]", 2);
+}
+
+/**
+ *  Start an operation line: {"op": "<op>", "path": "<path>", then the name
+ *  of the first value.
+ */
+
+static int diff_head(struct diff_t *diff, const char *op, const char *name) {
+    struct output_t *out = diff->out;
+    const char *chp = diff->path.data;
+    const char *end = chp + diff->path.used;
+    size_t len;
+
+    diff->changes++;
+    if (capture("{\"op\": \"", 8, out) != OK) return STREAM_WRITE_ERROR;
+    if (capture(op, strlen(op), out) != OK) return STREAM_WRITE_ERROR;
+    if (capture("\", \"path\": \"", 12, out) != OK) return STREAM_WRITE_ERROR;
+    while (chp < end) {
+        for (len = 0; chp + len < end && chp[len] != '"' && chp[len] != '\\'; len++);
+        if (capture(chp, len, out) != OK) return STREAM_WRITE_ERROR;
+        chp += len;
+        if (chp < end) {
+            if (capture("\\", 1, out) != OK || capture(chp++, 1, out) != OK) return STREAM_WRITE_ERROR;
+        }
+    }
+    if (capture("\", \"", 4, out) != OK) return STREAM_WRITE_ERROR;
+    if (capture(name, strlen(name), out) != OK) return STREAM_WRITE_ERROR;
+    if (capture("\": ", 3, out) != OK) return STREAM_WRITE_ERROR;
+    return OK;
+}
+
+/**
+ *  Report the value at the stream position as added or removed.
+ */
+
+static int diff_whole(struct diff_t *diff, struct json_stream_t *stream, const char *op) {
+    int code;
+
+    code = diff_head(diff, op, "value");
+    if (code != OK) return stream->code = code;
+    code = pipe_json(stream, diff->out);
+    if (code != OK && code != END_OF_STREAM) return code;
+    if (capture("}\n", 2, diff->out) != OK) return stream->code = STREAM_WRITE_ERROR;
+    return code;
+}
+
+/**
+ *  Read the key of the member at the stream position, without quotes, and
+ *  move on to its value.
+ */
+
+static int diff_key(struct json_stream_t *stream, struct arena_t *key) {
+    struct output_t out;
+
+    reset_arena(key);
+    init_arena_output(&out, key);
+    if (bump(stream, NULL) != OK) return stream->code;
+    if (string_body(stream, &out) != OK) return stream->code;
+    return search(stream, VALUE_TIPS, NULL);
+}
+
+/**
+ *  From just past a member, go to the next one or the closing character.
+ */
+
+static int diff_next(struct json_stream_t *stream, char close) {
+    if (stream->pos[0] == close) return OK;
+    return search(stream, (close == '}') ? "\"}" : ELEMENT_TIPS, NULL);
+}
+
+static int diff_pair(struct diff_t *diff, struct json_stream_t *a, struct json_stream_t *b);
+
+/**
+ *  Report the member at the stream position, key and all, as added or
+ *  removed.
+ */
+
+static int diff_member(struct diff_t *diff, struct json_stream_t *stream, const char *op) {
+    size_t saved = diff->path.used;
+    int code;
+
+    if (diff_key(stream, &diff->ka) != OK) return stream->code;
+    if (diff_push(diff, diff->ka.data, diff->ka.used, 0) != OK) return stream->code = OUT_OF_MEMORY;
+    code = diff_whole(diff, stream, op);
+    diff->path.used = saved;
+    if (code != OK) return code;
+    return diff_next(stream, '}');
+}
+
+/**
+ *  The members at a and b have different keys. Look ahead on both sides, a
+ *  member at a time, for the other side's key: found in b after k members,
+ *  those k were added; found in a, removed. If neither turns up, the two
+ *  members are reported as one removed and one added. Both streams are then
+ *  sought back to where they were, so the look-ahead costs time in the
+ *  distance to the next common key, not memory.
+ */
+
+static int diff_align(struct diff_t *diff, struct json_stream_t *a, struct json_stream_t *b,
+        long *removed, long *added) {
+    long oa = stream_offset(a);
+    long ob = stream_offset(b);
+    long steps;
+
+    *removed = *added = 1;
+    if (diff_key(a, &diff->ka) != OK || skip_value(a) != OK || diff_next(a, '}') != OK) return a->code;
+    if (diff_key(b, &diff->kb) != OK || skip_value(b) != OK || diff_next(b, '}') != OK) return b->code;
+
+    for (steps = 1; a->pos[0] != '}' || b->pos[0] != '}'; steps++) {
+        if (a->pos[0] != '}') {
+            if (diff_key(a, &diff->key) != OK) return a->code;
+            if (diff->key.used == diff->kb.used && memcmp(diff->key.data, diff->kb.data, diff->key.used) == 0) {
+                *removed = steps;
+                *added = 0;
+                break;
+            }
+            if (skip_value(a) != OK || diff_next(a, '}') != OK) return a->code;
+        }
+        if (b->pos[0] != '}') {
+            if (diff_key(b, &diff->key) != OK) return b->code;
+            if (diff->key.used == diff->ka.used && memcmp(diff->key.data, diff->ka.data, diff->key.used) == 0) {
+                *removed = 0;
+                *added = steps;
+                break;
+            }
+            if (skip_value(b) != OK || diff_next(b, '}') != OK) return b->code;
+        }
+    }
+
+    if (seek_stream(a, oa) != OK) return a->code;
+    return seek_stream(b, ob);
+}
+
+/**
+ *  With both streams on a member or the closing '}', diff the rest of an
+ *  object.
+ */
+
+static int diff_members(struct diff_t *diff, struct json_stream_t *a, struct json_stream_t *b) {
+    size_t saved = diff->path.used;
+    long removed;
+    long added;
+    long oa;
+    long ob;
+    int code;
+    int ca;
+    int cb;
+
+    while (a->pos[0] != '}' || b->pos[0] != '}') {
+        if (a->pos[0] == '}') {
+            code = diff_member(diff, b, "added");
+        }
+        else if (b->pos[0] == '}') {
+            code = diff_member(diff, a, "removed");
+        }
+        else {
+            oa = stream_offset(a);
+            ob = stream_offset(b);
+            if (diff_key(a, &diff->ka) != OK) return a->code;
+            if (diff_key(b, &diff->kb) != OK) return b->code;
+            if (diff->ka.used == diff->kb.used && memcmp(diff->ka.data, diff->kb.data, diff->ka.used) == 0) {
+                if (diff_push(diff, diff->ka.data, diff->ka.used, 0) != OK) return OUT_OF_MEMORY;
+                code = diff_pair(diff, a, b);
+                diff->path.used = saved;
+                if (code != OK) return code;
+                if (diff_next(a, '}') != OK) return a->code;
+                code = diff_next(b, '}');
+            }
+            else {
+                if (seek_stream(a, oa) != OK) return a->code;
+                if (seek_stream(b, ob) != OK) return b->code;
+                code = diff_align(diff, a, b, &removed, &added);
+                while (code == OK && removed-- > 0) code = diff_member(diff, a, "removed");
+                while (code == OK && added-- > 0) code = diff_member(diff, b, "added");
+            }
+        }
+        if (code != OK) return code;
+    }
+
+    ca = bump(a, NULL);
+    cb = bump(b, NULL);
+    return (ca != OK) ? ca : cb;
+}
+
+/**
+ *  With both streams on element index or the closing ']', diff the rest of
+ *  an array.
+ */
+
+static int diff_elements(struct diff_t *diff, struct json_stream_t *a, struct json_stream_t *b, long index) {
+    size_t saved = diff->path.used;
+    int code;
+    int ca;
+    int cb;
+
+    for (; a->pos[0] != ']' || b->pos[0] != ']'; index++) {
+        if (diff_push(diff, NULL, 0, index) != OK) return OUT_OF_MEMORY;
+        if (a->pos[0] == ']') code = diff_whole(diff, b, "added");
+        else if (b->pos[0] == ']') code = diff_whole(diff, a, "removed");
+        else code = diff_pair(diff, a, b);
+        diff->path.used = saved;
+        if (code != OK) return code;
+        if (diff_next(a, ']') != OK) return a->code;
+        if (diff_next(b, ']') != OK) return b->code;
+    }
+
+    ca = bump(a, NULL);
+    cb = bump(b, NULL);
+    return (ca != OK) ? ca : cb;
+}
+
+/**
+ *  With both streams on the opening character of a collection, or on a comma
+ *  inside it, diff what follows.
+ */
+
+static int diff_object(struct diff_t *diff, struct json_stream_t *a, struct json_stream_t *b) {
+    if (search(a, "\"}", NULL) != OK) return a->code;
+    if (search(b, "\"}", NULL) != OK) return b->code;
+    return diff_members(diff, a, b);
+}
+
+static int diff_array(struct diff_t *diff, struct json_stream_t *a, struct json_stream_t *b, long index) {
+    if (search(a, ELEMENT_TIPS, NULL) != OK) return a->code;
+    if (search(b, ELEMENT_TIPS, NULL) != OK) return b->code;
+    return diff_elements(diff, a, b, index);
+}
+
+/**
+ *  Pick up where same_collection() stopped, at level k of diff->levels.
+ *  Up to the difference, both sides are the same, so level k is entered in
+ *  the first stream only, to read the key or index leading to level k + 1,
+ *  and both are sought to the boundary of the innermost level, where the
+ *  members or elements are diffed one by one. Then the rest of each level
+ *  is diffed on the way back out. Each seek lands within one member of the
+ *  difference; nothing is read twice but the member holding it.
+ *
+ *  The offset of a boundary in the second stream is shift more than in the
+ *  first. Both streams are left just past the collection of level k.
+ */
+
+static int diff_resume(struct diff_t *diff, struct json_stream_t *a, struct json_stream_t *b,
+        long shift, long k, long count) {
+    struct diff_level_t level = diff->levels[k];
+    size_t saved = diff->path.used;
+    char close = (level.open == '{') ? '}' : ']';
+    int code;
+
+    if (k + 1 == count) {
+        if (seek_stream(a, level.at) != OK) return a->code;
+        if (seek_stream(b, level.at + shift) != OK) return b->code;
+        if (level.open == '{') return diff_object(diff, a, b);
+        return diff_array(diff, a, b, level.index);
+    }
+
+    if (level.open == '{') {
+        if (seek_stream(a, level.at) != OK) return a->code;
+        if (search(a, "\"", NULL) != OK) return a->code;
+        if (diff_key(a, &diff->ka) != OK) return a->code;
+        code = diff_push(diff, diff->ka.data, diff->ka.used, 0);
+    }
+    else {
+        code = diff_push(diff, NULL, 0, level.index);
+    }
+    if (code != OK) return OUT_OF_MEMORY;
+
+    code = diff_resume(diff, a, b, shift, k + 1, count);
+    diff->path.used = saved;
+    if (code != OK) return code;
+
+    if (diff_next(a, close) != OK) return a->code;
+    if (diff_next(b, close) != OK) return b->code;
+    if (level.open == '{') return diff_members(diff, a, b);
+    return diff_elements(diff, a, b, level.index + 1);
+}
+
+/**
+ *  Compare the values at a and b, reporting what changed below the current
+ *  path. Like the skip functions, leaves both streams just past their
+ *  values.
+ */
+
+static int diff_pair(struct diff_t *diff, struct json_stream_t *a, struct json_stream_t *b) {
+    struct output_t out;
+    long shift = stream_offset(b) - stream_offset(a);
+    long count = 0;
+    int code;
+    int ca;
+    int cb;
+
+    if ((a->pos[0] == '{' || a->pos[0] == '[') && a->pos[0] == b->pos[0]) {
+        code = same_collection(diff, a, b, &count);
+        if (code != OK || count == 0) return code;
+
+        // They differ somewhere inside: pick up from there.
+        return diff_resume(diff, a, b, shift, 0, count);
+    }
+
+    if (a->pos[0] == '{' || a->pos[0] == '[' || b->pos[0] == '{' || b->pos[0] == '[') {
+        // A collection against something else.
+        code = diff_head(diff, "changed", "from");
+        if (code != OK) return code;
+        ca = pipe_json(a, diff->out);
+        if (ca != OK && ca != END_OF_STREAM) return ca;
+        if (capture(", \"to\": ", 8, diff->out) != OK) return STREAM_WRITE_ERROR;
+        cb = pipe_json(b, diff->out);
+        if (cb != OK && cb != END_OF_STREAM) return cb;
+        if (capture("}\n", 2, diff->out) != OK) return STREAM_WRITE_ERROR;
+        return (ca != OK) ? ca : cb;
+    }
+
+    // Scalars are read whole and compared.
+    reset_arena(&diff->ka);
+    init_arena_output(&out, &diff->ka);
+    ca = pipe_json(a, &out);
+    if (ca != OK && ca != END_OF_STREAM) return ca;
+    reset_arena(&diff->kb);
+    init_arena_output(&out, &diff->kb);
+    cb = pipe_json(b, &out);
+    if (cb != OK && cb != END_OF_STREAM) return cb;
+
+    if (diff->ka.used != diff->kb.used || memcmp(diff->ka.data, diff->kb.data, diff->ka.used) != 0) {
+        code = diff_head(diff, "changed", "from");
+        if (code != OK) return code;
+        if (capture(diff->ka.data, diff->ka.used, diff->out) != OK ||
+                capture(", \"to\": ", 8, diff->out) != OK ||
+                capture(diff->kb.data, diff->kb.used, diff->out) != OK ||
+                capture("}\n", 2, diff->out) != OK) {
+            return STREAM_WRITE_ERROR;
+        }
+    }
+    return (ca != OK) ? ca : cb;
+}
+
+int diff_value(struct json_stream_t *a, struct json_stream_t *b, const char *path, struct output_t *out) {
+#ifdef JVDEBUG
+    fprintf(stdout, "Diffing values\n");
+#endif
+    struct diff_t diff;
+    int code;
+
+    diff.out = out;
+    diff.changes = 0;
+    diff.levels = NULL;
+    diff.size = 0;
+    init_arena(&diff.path);
+    init_arena(&diff.ka);
+    init_arena(&diff.kb);
+    init_arena(&diff.key);
+
+    code = arena_append(&diff.path, path, strlen(path));
+    if (code == OK) {
+        if (a == NULL) code = diff_whole(&diff, b, "added");
+        else if (b == NULL) code = diff_whole(&diff, a, "removed");
+        else code = diff_pair(&diff, a, b);
+    }
+
+    free_arena(&diff.path);
+    free_arena(&diff.ka);
+    free_arena(&diff.kb);
+    free_arena(&diff.key);
+    free(diff.levels);
+
+    if ((code == OK || code == END_OF_STREAM) && diff.changes > 0) return VALUES_DIFFER;
+    return code;
+}
@@ -2,6 +2,10 @@
 #define JVBUF 256
 #endif
 
+#ifndef JVHOLD
+#define JVHOLD (64L * 1024 * 1024)
+#endif
+
 #define JVBYTE sizeof(char)
 
 enum return_code_t {
@@ -16,14 +20,29 @@ enum return_code_t {
     KEY_MISMATCH,
     BAD_PATH_STRING,
     EMPTY_PATH_STRING,
-    WRITE_ERROR
+    WRITE_ERROR,
+    OUT_OF_MEMORY,
+    VALUES_DIFFER
 };
 
 
 enum key_type_t {
     ARRAY_INDEX,
     BRACKETED_NAME,
-    NAME
+    NAME,
+    RECURSIVE_NAME,
+    ARRAY_WILDCARD
+};
+
+/**
+ *  What pipe_value() writes: the JSON text, or the value transcoded to a
+ *  binary format.
+ */
+
+enum encoding_t {
+    ENCODE_JSON,
+    ENCODE_CBOR,
+    ENCODE_MSGPACK
 };
 
 /**
@@ -72,6 +91,19 @@ struct key_t {
  *      a.b["c"].d
  *         ^
  *
+ *      a..d
+ *       ^
+ *
+ *      a[-1]
+ *       ^
+ *
+ *      a[*].b
+ *       ^
+ *
+ *  A "..name" key is a RECURSIVE_NAME key; it matches the key name at any
+ *  depth below the current value. A negative ARRAY_INDEX counts from the end
+ *  of the array; only scan_tail() (see below) resolves those. A "[*]" key is
+ *  an ARRAY_WILDCARD key, matching every element of an array.
  *
  *  Returns
  *
@@ -82,6 +114,15 @@ struct key_t {
 
 int get_key(const char *path, struct key_t *key);
 
+/**
+ *  Whether the path has a RECURSIVE_NAME or ARRAY_WILDCARD key, and so may
+ *  match many times (see the walk functions). Decided from the parsed keys,
+ *  so a bracketed name like ["a..b"] does not count. A bad path does not
+ *  either; the scan reports it.
+ */
+
+int path_walks(const char *path);
+
 
 /**
  *  Some JSON type ids.
@@ -94,7 +135,8 @@ enum value_type_t {
     COLLECTION,
     NUMBER,
     NIL,
-    PRIMITIVE
+    PRIMITIVE,
+    BOOLEAN
 };
 
 /**
@@ -102,7 +144,124 @@ enum value_type_t {
  *  or object value).
  */
 
-const char VALUE_TIPS[] = "{[\"0123456789-n";
+const char VALUE_TIPS[] = "{[\"0123456789-ntf";
+
+/**
+ *  Characters that mark the beginning of an array element or the end of the
+ *  array.
+ */
+
+const char ELEMENT_TIPS[] = "]{[\"0123456789-ntf";
+
+/**
+ *  A growable block of memory for collecting output. It only ever grows (by
+ *  doubling), so resetting it between queries reuses what it already holds
+ *  and a steady stream of similar queries stops allocating altogether.
+ */
+
+struct arena_t {
+    /**
+     *  The memory; data[used] is always a null char. NULL until something
+     *  is written.
+     */
+
+    char *data;
+
+    /**
+     *  Number of bytes allocated.
+     */
+
+    size_t size;
+
+    /**
+     *  Number of bytes written, not counting the null char.
+     */
+
+    size_t used;
+};
+
+/**
+ *  Start with an empty arena. Nothing is allocated until the first write.
+ */
+
+void init_arena(struct arena_t *arena);
+
+/**
+ *  Forget the contents but keep the memory for the next query.
+ */
+
+void reset_arena(struct arena_t *arena);
+
+/**
+ *  Give the memory back.
+ */
+
+void free_arena(struct arena_t *arena);
+
+/**
+ *  Append len bytes, growing the arena if needed.
+ *
+ *  Returns OK or OUT_OF_MEMORY.
+ */
+
+int arena_append(struct arena_t *arena, const char *string, size_t len);
+
+
+/**
+ *  Structural state carried from one block of characters to the next (and
+ *  across buffer reads) by classify_block(). Zero it before the first block;
+ *  the first character must not be inside a string.
+ */
+
+struct scan_state_t {
+    /**
+     *  Nonzero if the previous block ended inside a string.
+     */
+
+    int in_string;
+
+    /**
+     *  Nonzero if the previous block ended with an unescaped backslash, so
+     *  the first character of the next block is escaped.
+     */
+
+    int escaped;
+};
+
+/**
+ *  Value of output_t.indent for copying collections as they are.
+ */
+
+#define JVRAW -1
+
+/**
+ *  Where the output formatter is in the collection it is laying out.
+ *
+ *  Internal use only.
+ */
+
+struct format_t {
+    /**
+     *  Nonzero while a collection is being piped.
+     */
+
+    int active;
+
+    struct scan_state_t scan;
+
+    /**
+     *  Nesting depth in the collection.
+     */
+
+    int depth;
+
+    /**
+     *  Nonzero right after an opening '{' or '['. The line break before the
+     *  first member is held back until we know the collection is not empty.
+     */
+
+    int fresh;
+};
 
 /**
  *  Abstract different ways of capturing stream output from this
@@ -139,6 +298,42 @@ struct output_t {
      */
 
     char *mem_pos;
+
+    /**
+     *  If not NULL, jv appends to it. Unlike mem, this never truncates.
+     */
+
+    struct arena_t *arena;
+
+    /**
+     *  Set by slice_value() to the location and length of the value it
+     *  captured. See below.
+     */
+
+    const char *slice;
+    size_t slice_len;
+
+    /**
+     *  How piped objects and arrays are laid out: JVRAW (the default) copies
+     *  them as they are, 0 removes all whitespace outside strings, and a
+     *  positive number pretty-prints them with that many spaces per level.
+     *  Formatting happens as the characters are captured, in the same pass.
+     */
+
+    int indent;
+
+    /**
+     *  ENCODE_JSON (the default), or a binary format pipe_value() transcodes
+     *  values to instead. See encode_value().
+     */
+
+    enum encoding_t encoding;
+
+    /**
+     *  Internal use only.
+     */
+
+    struct format_t format;
 };
 
 
@@ -149,6 +344,12 @@ struct output_t {
 
 void init_output(struct output_t *out, FILE *fp, char *mem, size_t size);
 
+/**
+ *  Initialize an output struct that collects into an arena.
+ */
+
+void init_arena_output(struct output_t *out, struct arena_t *arena);
+
 /**
  *  Capture some string data with an output struct.
  */
@@ -169,7 +370,14 @@ struct json_stream_t {
     char buffer[JVBUF + 1];
 
     /**
-     *  Current position in buffer. When a new buffer is read in from the
+     *  The characters being read: the buffer, or for in-memory streams the
+     *  whole input string.
+     */
+
+    const char *span;
+
+    /**
+     *  Current position in span. When a new buffer is read in from the
      *  source, this points at the first character. Searching and bumping
      *  are the valid ways to move this along.
      */
@@ -186,11 +394,36 @@ struct json_stream_t {
     char prev_char;
 
     /**
-     *  The source.
+     *  The source. NULL for in-memory streams.
      */
 
     FILE *src;
 
+    /**
+     *  Source offset of the first character in the buffer. Together with
+     *  the buffer position, this locates values in seekable sources.
+     */
+
+    long offset;
+
+    /**
+     *  If not NULL, everything the stream passes over is copied here, from
+     *  echo_pos on, a buffer at a time. Used by edit_value().
+     *
+     *  Internal.
+     */
+
+    struct output_t *echo;
+    const char *echo_pos;
+
+    /**
+     *  If set, the source may still grow: reading past its end clears the
+     *  end-of-file indicator first and tries again. Off by default, so
+     *  that a terminal or a pipe ends at the first end-of-file.
+     */
+
+    int follow;
+
     /**
      *  When a stream is passed to a function that ultimately fails, the
      *  error code is stored here so that the function is free to customize
@@ -208,13 +441,37 @@ struct json_stream_t {
 
 int init_stream(struct json_stream_t *stream, FILE *src);
 
+/**
+ *  Initialize a JSON stream over a null-terminated string already in memory
+ *  (a whole file read in by the caller, say). Nothing is copied; the stream
+ *  reads the string in place, and it must outlive the stream.
+ */
+
+int init_stream_string(struct json_stream_t *stream, const char *json);
+
 /**
  *  Force the json_stream to read from the source. This does not check
  *  if the stream position is at the end.
+ *
+ *  END_OF_STREAM is not final: the stream is left as it was, and a later
+ *  read() picks up whatever was appended to the source in the meantime.
  */
 
 int read(struct json_stream_t *stream);
 
+/**
+ *  Source offset of the character at the current stream position.
+ */
+
+long stream_offset(struct json_stream_t *stream);
+
+/**
+ *  Move the stream to a source offset and read from there. The source must
+ *  be seekable.
+ */
+
+int seek_stream(struct json_stream_t *stream, long offset);
+
 /**
  *  Move the stream position forward by one character. Automatically
  *  reads from the stream source if necessary.
@@ -260,6 +517,88 @@ int search(struct json_stream_t *stream, const char *chars, struct output_t *out
 
 int traverse_collection(struct json_stream_t *stream, char open, int count, struct output_t *out);
 
+/**
+ *  Bitmasks describing a block of up to 64 characters; bit i stands for the
+ *  i-th character. Structural characters inside strings are masked out.
+ */
+
+struct block_t {
+    /**
+     *  Characters inside strings, counting the opening quote but not the
+     *  closing one.
+     */
+
+    uint64_t string;
+
+    /**
+     *  '{' and '[' outside strings.
+     */
+
+    uint64_t open;
+
+    /**
+     *  '}' and ']' outside strings.
+     */
+
+    uint64_t close;
+
+    /**
+     *  ',' outside strings.
+     */
+
+    uint64_t comma;
+
+    /**
+     *  ':' outside strings.
+     */
+
+    uint64_t colon;
+
+    /**
+     *  Whitespace (in fact, anything up to ' ') outside strings.
+     */
+
+    uint64_t space;
+};
+
+/**
+ *  Classify len (at most 64) characters at once. Equality tests run eight
+ *  characters per machine word, and the in-string mask is a prefix xor over
+ *  the unescaped quotes, so there is no per-character branching except on
+ *  backslashes, which are rare.
+ */
+
+void classify_block(const char *chars, size_t len, struct scan_state_t *state, struct block_t *block);
+
+/**
+ *  Bit-parallel fast-forward over structure, 64 characters at a time. Whole
+ *  blocks whose closing brackets cannot bring the depth to zero are passed by
+ *  popcount alone.
+ *
+ *  On input, the stream must NOT be inside a string; the character at the
+ *  stream position is scanned too. depth is the number of collections
+ *  already entered.
+ *
+ *  On output, the stream points to the closing '}' or ']' that brings the
+ *  depth to zero, or to the limit-th ',' seen at depth 1, whichever comes
+ *  first. A negative limit means no comma limit.
+ *
+ *  Hence, from inside an object or array:
+ *
+ *      fast_forward(stream, 1, -1, NULL, NULL)  goes to its closing char,
+ *      fast_forward(stream, 1, 1, NULL, NULL)   goes to the next sibling's
+ *                                               comma (or the closing char),
+ *
+ *  and from the opening '[', fast_forward(stream, 0, k, NULL, NULL) passes k
+ *  array elements.
+ *
+ *  If passed is not NULL, it receives the number of commas seen at depth 1.
+ *  If out is not NULL, everything traversed (but not the final character) is
+ *  captured.
+ */
+
+int fast_forward(struct json_stream_t *stream, int depth, long limit, long *passed, struct output_t *out);
+
 /**
  *  Infer from description of traverse collection above.
  */
@@ -267,6 +606,7 @@ int traverse_collection(struct json_stream_t *stream, char open, int count, stru
 int traverse_string(struct json_stream_t *stream, struct output_t *out);
 int traverse_number(struct json_stream_t *stream, struct output_t *out);
 int traverse_null(struct json_stream_t *stream, struct output_t *out);
+int traverse_boolean(struct json_stream_t *stream, struct output_t *out);
 
 /**
  *  Derivatives of the traverse functions, without capturing output.
@@ -276,6 +616,7 @@ int skip_collection(struct json_stream_t *stream);
 int skip_string(struct json_stream_t *stream);
 int skip_number(struct json_stream_t *stream);
 int skip_null(struct json_stream_t *stream);
+int skip_boolean(struct json_stream_t *stream);
 
 /**
  *  Generic form for above skip functions; basically a map from stream position
@@ -320,8 +661,10 @@ int skip_value(struct json_stream_t *stream);
  *  first character of the value, ready for piping, and the returned path is an
  *  empty C-string.
  *
- *  If the path and object keys do not match, the stream will skip
- *  ahead and point to the first char after the associated value.
+ *  If the path and object keys do not match, the stream fast-forwards to the
+ *  ',' or '}' that follows the associated value. If the key matches but the
+ *  value does not contain the rest of the path, the stream points to the
+ *  first char after the value. Either way, the given path is returned.
  */
 
 const char *scan_pair(struct json_stream_t *stream, const char *path);
@@ -383,6 +726,98 @@ const char *scan_array(struct json_stream_t *stream, const char *path);
 const char *scan_value(struct json_stream_t *stream, const char *path);
 
 
+/**
+ *  Resolve a path with negative array indices ("features[-1]"). The keys
+ *  before a negative index are found forward, as scan_value() finds them,
+ *  which leaves the stream on the opening bracket of the array. That bracket
+ *  is the anchor: the elements are read backward from the closing bracket,
+ *  never past the anchor. Quotes are told apart from escaped quotes by the
+ *  parity of the backslashes before them. The stream is then moved to the
+ *  element found, and the rest of the path is resolved the same way.
+ *
+ *  The closing bracket is read back to from the end of the input when the
+ *  array is the whole document, and from the end of the element found last
+ *  when the array is that element ("[-1][-2]"). Both cost about as much as
+ *  the elements read. An array found by key has no end that reading from the
+ *  end of the input could tell from that of a sibling after it, so it is
+ *  skipped in bulk to its closing bracket instead.
+ *
+ *  On input, the stream must point to the first character of a value in a
+ *  seekable source. A value with nothing but space before it is taken to be
+ *  the whole input.
+ *
+ *  Returns as a scan function does, except that when nothing matched, the
+ *  stream position is unspecified. Errors include ARRAY_INDEX_ERROR for an
+ *  unseekable source or a path with "..name" or "[*]" before a negative
+ *  index.
+ */
+
+const char *scan_tail(struct json_stream_t *stream, const char *path);
+
+
+/**
+ *  Walk functions. Where a scan function stops at the first match, a walk
+ *  function visits every match in the value, in document order (but see
+ *  below for matches inside matches), handing each one to a callback as soon
+ *  as it is reached. This is how RECURSIVE_NAME
+ *  keys ("..name") are meant to be used:
+ *
+ *      ..name      every value of key "name", at any depth
+ *      a..name     the same, below a
+ *      ..a.b       the b of every a, including an a nested in another
+ *      a[*].b      the b of every element of a
+ *
+ *  The input is read once. Below a recursive key, the walk carries every
+ *  suffix of the path still to be matched at once: the recursive key's own,
+ *  and those of the keys after it wherever it matched. So "..a.b" finds the
+ *  b of an a nested in another a, and "..id" on {"id": {"id": 1}} visits
+ *  {"id": 1}, then 1. A match that the path goes on inside, like that outer
+ *  {"id": 1}, is held in memory until it ends, since the matches inside it
+ *  are handed over after it; they come out of the same copy. Strings and
+ *  other scalars that cannot contain matches are skipped whole.
+ */
+
+/**
+ *  Called with the stream pointing to the first character of a matched
+ *  value. The callback must consume the value (pipe it, skip it, ...) and
+ *  leave the stream just past it. Returning anything but OK stops the walk,
+ *  and the walk function returns that code.
+ */
+
+typedef int (*match_fn)(struct json_stream_t *stream, void *data);
+
+/**
+ *  On input, the stream points to the first character of the value. On
+ *  output, it points to the first character after the value.
+ *
+ *  Returns OK once the whole value has been walked, otherwise an error code
+ *  (or whatever the callback returned).
+ */
+
+int walk_value(struct json_stream_t *stream, const char *path, match_fn fn, void *data);
+
+/**
+ *  Walk the object or array at the stream position (see walk_value).
+ */
+
+int walk_object(struct json_stream_t *stream, const char *path, match_fn fn, void *data);
+int walk_array(struct json_stream_t *stream, const char *path, match_fn fn, void *data);
+
+/**
+ *  Called like a match_fn, with the number (from 0) of the path matched.
+ */
+
+typedef int (*paths_fn)(struct json_stream_t *stream, int which, void *data);
+
+/**
+ *  Walk the value at the stream position for count paths at once, reading
+ *  it once. A value matched by more than one path is held like one with
+ *  matches inside, and handed over once per path, in the paths' order.
+ */
+
+int walk_paths(struct json_stream_t *stream, const char **paths, int count, paths_fn fn, void *data);
+
+
 /**
  *  Pipe functions. Traverse values while capturing their contents.
  */
@@ -396,5 +831,176 @@ int pipe_collection(struct json_stream_t *stream, struct output_t *out);
 int pipe_string(struct json_stream_t *stream, struct output_t *out);
 int pipe_number(struct json_stream_t *stream, struct output_t *out);
 int pipe_null(struct json_stream_t *stream, struct output_t *out);
+int pipe_boolean(struct json_stream_t *stream, struct output_t *out);
+
+/**
+ *  Unless out->encoding is ENCODE_JSON, the value is handed to
+ *  encode_value() instead.
+ */
 
 int pipe_value(struct json_stream_t *stream, struct output_t *out);
+
+/**
+ *  Same as pipe_value(), except that strings keep their quotes: the output
+ *  is the value as JSON.
+ */
+
+int pipe_json(struct json_stream_t *stream, struct output_t *out);
+
+/**
+ *  Capture the text a JSON string stands for, given its characters between
+ *  the quotes: escapes are decoded, and \\u escapes (surrogate pairs
+ *  included) are written as UTF-8. Malformed escapes are captured as they
+ *  are.
+ */
+
+int unescape_string(const char *chars, size_t len, struct output_t *out);
+
+/**
+ *  Transcode the value at the stream position to out->encoding as it is
+ *  read. Strings have their escapes decoded and are written with their
+ *  length in front. Numbers become uint64 or int64 if they are integers
+ *  that fit (uint64 if not negative), and float64 otherwise, -0 included.
+ *
+ *  CBOR objects and arrays are written with indefinite lengths, so nothing
+ *  is held back but the current string. MessagePack needs the number of
+ *  members up front, as a 32-bit count. If the input can be read twice
+ *  (a string, or a seekable file), each collection's members are counted
+ *  in a skip pass first, then written as they are read. Otherwise the value
+ *  is built in memory with placeholders for the counts, patched in as each
+ *  collection closes, and captured whole at the end; past JVHOLD bytes it
+ *  fails with OUT_OF_MEMORY, and nothing of it is captured.
+ *
+ *  Same contract as pipe_value() otherwise.
+ */
+
+int encode_value(struct json_stream_t *stream, struct output_t *out);
+
+/**
+ *  Capture the bytes between source offsets start (inclusive) and end
+ *  (exclusive). The stream position is left alone. On Linux, when the
+ *  output is a plain FILE (no mem), the bytes are handed to sendfile(2) and
+ *  never pass through user space; otherwise, or when the kernel refuses,
+ *  they are copied in JVBUF sized chunks.
+ *
+ *  The source must be seekable.
+ */
+
+int pipe_range(struct json_stream_t *stream, long start, long end, struct output_t *out);
+
+/**
+ *  Same contract as pipe_value(). For collections and strings in a seekable
+ *  source, the end of the value is found with the skip functions and the
+ *  bytes are then moved with pipe_range(), rather than being captured
+ *  piecemeal while traversing.
+ */
+
+int transfer_value(struct json_stream_t *stream, struct output_t *out);
+
+/**
+ *  Same contract as pipe_value(), but afterwards out->slice and
+ *  out->slice_len describe the value as written in the input (strings
+ *  without their quotes).
+ *
+ *  When the whole value is in the stream's current span, it is not captured
+ *  at all: the slice points into the input. For in-memory streams, that is
+ *  always the case; for a source, the slice is valid until the next read
+ *  from the stream. Otherwise, the value is captured into out->arena as it
+ *  is read and the slice points there, valid until the arena is next written
+ *  to or reset. Without an arena, the value from a source is piped as usual
+ *  and the slice is NULL.
+ */
+
+int slice_value(struct json_stream_t *stream, struct output_t *out);
+
+
+/**
+ *  Copy the whole stream to out, replacing the value at path with the given
+ *  JSON text, or deleting it (with its key, and a comma) if json is NULL.
+ *  The stream points to the first character of the top-level value.
+ *
+ *  Everything outside the matched value is copied as it is read, a buffer
+ *  at a time, and the matched value itself is skipped, not captured; only
+ *  the separator and key in front of the last path key are held back, in
+ *  case they go too. So memory use does not depend on the input. After the
+ *  edit, the rest of a seekable source goes out through pipe_range().
+ *
+ *  The path must end in a name or a non-negative array index; recursive
+ *  keys, wildcards and negative indices are not supported.
+ *
+ *  Returns OK if a value was edited, END_OF_STREAM if nothing matched (the
+ *  stream is then copied unchanged), or an error code.
+ */
+
+int edit_value(struct json_stream_t *stream, const char *path, const char *json, struct output_t *out);
+
+
+/**
+ *  Aggregate functions. Reduce a value without capturing it: members are
+ *  counted with the same block masks fast_forward() skips with, and numbers
+ *  are parsed where they lie in the buffer. Like the skip functions, they
+ *  take the stream at the first character of the value and leave it just
+ *  past the value.
+ */
+
+/**
+ *  Count the members of the object or array at the stream position (pairs
+ *  of an object, elements of an array).
+ *
+ *  Returns OK, NOT_AT_VALUE if the value is not a collection, or an error
+ *  code.
+ */
+
+int count_members(struct json_stream_t *stream, long *count);
+
+/**
+ *  Capture the keys of the object at the stream position, each followed by
+ *  a newline and, like pipe_string(), without quotes. Values are skipped.
+ *
+ *  Returns OK, NOT_AT_VALUE if the value is not an object, or an error code.
+ */
+
+int pipe_keys(struct json_stream_t *stream, struct output_t *out);
+
+/**
+ *  Convert the number at the stream position with strtod(). A number that
+ *  lies whole in the buffer is converted in place; one cut by the end of the
+ *  buffer is first gathered across reads, however long it is.
+ *
+ *  Returns OK, NOT_AT_VALUE if the value is not a number, or an error code.
+ */
+
+int read_number(struct json_stream_t *stream, double *value);
+
+
+/**
+ *  Report how the value at b differs from the value at a, as one line of
+ *  JSON per difference, written to out:
+ *
+ *      {"op": "changed", "path": "a.b", "from": 1, "to": 2}
+ *      {"op": "added", "path": "a.c", "value": [3]}
+ *      {"op": "removed", "path": "a.d[2]", "value": "x"}
+ *
+ *  Paths start with the given path. Both streams point to the first
+ *  character of their values; pass NULL for a value that does not exist,
+ *  and the other is reported whole.
+ *
+ *  The streams are advanced in lockstep. Collections of the same kind are
+ *  compared as raw bytes, a block at a time, keeping track of the structure
+ *  passed over. At the first difference, both streams are sought back to
+ *  the start of the member or element holding it (which is all that gets
+ *  read twice), and diffed from there one member or element at a time, each
+ *  compared as raw bytes again. Hence, both sources must be seekable, and
+ *  identical subtrees cost no more than reading them. Arrays are compared by
+ *  index. Object members are matched
+ *  by key in order: where the keys differ, both sides are scanned ahead for
+ *  the other's key to tell added members from removed ones. Scalars are
+ *  compared by their JSON text, so 1.0 and 1 differ. Memory use grows with
+ *  nesting depth and the longest key or scalar, not with the input.
+ *
+ *  Returns OK if the values are the same, VALUES_DIFFER if anything was
+ *  reported, or an error code. END_OF_STREAM may mean that the input ended
+ *  right after the values.
+ */
+
+int diff_value(struct json_stream_t *a, struct json_stream_t *b, const char *path, struct output_t *out);
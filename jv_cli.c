@@ -1,29 +1,2033 @@
 #include "jv.c"
+#ifndef JVNOTHREADS
+#include <pthread.h>
+#endif
+#include <sys/stat.h>
+#include <errno.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/sysinfo.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <poll.h>
+#endif
 
-int main(int argc, char **argv) {
+/**
+ *  Longest line accepted in a --files-from list.
+ */
+
+#define JVPATHMAX 4096
+
+/**
+ *  In --lines mode, output is held back per document and written out once
+ *  this much has gathered (or the input has run dry).
+ */
+
+#define JVFLUSH 65536
+
+/**
+ *  Longest wait, in milliseconds, before --follow checks the file again on
+ *  its own.
+ */
+
+#define JVWAIT 1000
+
+/**
+ *  Buffer size of each shard file written by --split.
+ */
+
+#define JVSHARDBUF (256 * 1024)
+
+/**
+ *  Rows per batch written by --columns.
+ */
+
+#ifndef JVROWS
+#define JVROWS 65536
+#endif
+
+/**
+ *  Ways to reduce the matches of a path instead of printing them.
+ */
+
+enum aggregate_t {
+    NO_AGGREGATE,
+
+    /**
+     *  Per match: members of an object or array, or the keys of an object.
+     */
+
+    AGGREGATE_LENGTH,
+    AGGREGATE_KEYS,
+
+    /**
+     *  Over all matches: how many there are, or the sum, minimum or maximum
+     *  of those that are numbers.
+     */
+
+    AGGREGATE_COUNT,
+    AGGREGATE_SUM,
+    AGGREGATE_MIN,
+    AGGREGATE_MAX
+};
+
+/**
+ *  What was asked for on the command line.
+ */
+
+struct options_t {
+    const char *path;
+
+    /**
+     *  Layout of piped objects and arrays, as in output_t.
+     */
+
+    int indent;
+
+    enum aggregate_t aggregate;
+
+    /**
+     *  The input is a sequence of documents, one per line (NDJSON).
+     */
+
+    int lines;
+
+    /**
+     *  With lines: keep reading as the file grows.
+     */
+
+    int follow;
+
+    /**
+     *  With lines: file keeping the offset of the next document, or NULL.
+     */
+
+    const char *state;
+
+    /**
+     *  For --set and --delete: the whole input is copied to stdout, with
+     *  the value at path replaced by json (NULL to delete it).
+     */
+
+    int edit;
+    const char *json;
+
+    /**
+     *  For --split: the elements of the array at path go to this many shard
+     *  files in outdir, round-robin or, with balance, by size.
+     */
+
+    int split;
+    int shards;
+    const char *outdir;
+    int balance;
+
+    /**
+     *  For --columns: "path:type,..." to project out of every match.
+     */
+
+    char *columns;
+
+    /**
+     *  For --schema: report the shape of the matches instead, with key
+     *  counts for objects if key_counts is set.
+     */
+
+    int schema;
+    int key_counts;
+
+    /**
+     *  For --diff: compare the matches in two files instead.
+     */
+
+    int diff;
+
+    /**
+     *  For --format: how matched values are written.
+     */
+
+    enum encoding_t encoding;
+
+    /**
+     *  For --sample: pick this many matches at random, with a generator
+     *  seeded from seed (or the clock, if seeded is not set).
+     */
+
+    long sample;
+    uint64_t seed;
+    int seeded;
+};
+
+/**
+ *  Collects matches from a walk.
+ */
+
+struct matches_t {
+    struct output_t *out;
+    enum aggregate_t aggregate;
+    long count;
+
+    /**
+     *  Numbers among the matches, and their sum, minimum or maximum.
+     */
+
+    long numbers;
+    double total;
+
+    /**
+     *  If not NULL, printed (with a ':') before every match.
+     */
+
+    const char *prefix;
+};
+
+/**
+ *  Pipe a match on its own line.
+ */
+
+static int pipe_match(struct json_stream_t *stream, void *data) {
+    struct matches_t *matches = (struct matches_t *)data;
+    int code;
+
+    matches->count++;
+    if (matches->prefix != NULL) {
+        code = capture(matches->prefix, strlen(matches->prefix), matches->out);
+        if (code == OK) code = capture(":", 1, matches->out);
+        if (code != OK) return code;
+    }
+    code = pipe_value(stream, matches->out);
+    if (code != OK && code != END_OF_STREAM) return code;
+    // Binary values need no separator.
+    if (matches->out->encoding != ENCODE_JSON) return code;
+    if (capture("\n", 1, matches->out) != OK) return STREAM_WRITE_ERROR;
+    return code;
+}
+
+/**
+ *  Print one line of aggregate output, after the prefix if there is one.
+ */
+
+static int print_line(struct matches_t *matches, const char *text, size_t len) {
+    struct output_t *out = matches->out;
+
+    if (matches->prefix != NULL) {
+        if (capture(matches->prefix, strlen(matches->prefix), out) != OK) return STREAM_WRITE_ERROR;
+        if (capture(":", 1, out) != OK) return STREAM_WRITE_ERROR;
+    }
+    if (capture(text, len, out) != OK) return STREAM_WRITE_ERROR;
+    if (capture("\n", 1, out) != OK) return STREAM_WRITE_ERROR;
+    return OK;
+}
+
+/**
+ *  Format a number as briefly as it survives a round trip.
+ */
+
+static void format_number(char *text, size_t size, double value) {
+    snprintf(text, size, "%.15g", value);
+    if (strtod(text, NULL) != value) snprintf(text, size, "%.17g", value);
+}
+
+static int print_number(struct matches_t *matches, double value) {
+    char text[32];
+
+    format_number(text, sizeof(text), value);
+    return print_line(matches, text, strlen(text));
+}
+
+/**
+ *  Fold a match into an aggregate. Nothing is piped: collections are counted
+ *  or skipped, and numbers are read in place.
+ */
+
+static int reduce_match(struct json_stream_t *stream, void *data) {
+    struct matches_t *matches = (struct matches_t *)data;
+    struct arena_t arena;
+    struct output_t keys;
+    char text[24];
+    char *line;
+    char *end;
+    double value;
+    long count;
+    int code;
+
+    matches->count++;
+    switch (matches->aggregate) {
+        case AGGREGATE_LENGTH: {
+            code = count_members(stream, &count);
+            if (code != OK && code != END_OF_STREAM) return code;
+            snprintf(text, sizeof(text), "%ld", count);
+            if (print_line(matches, text, strlen(text)) != OK) return STREAM_WRITE_ERROR;
+            return code;
+        }
+        case AGGREGATE_KEYS: {
+            if (matches->prefix == NULL) return pipe_keys(stream, matches->out);
+
+            // Every key needs the prefix; gather them first.
+            init_arena(&arena);
+            init_arena_output(&keys, &arena);
+            code = pipe_keys(stream, &keys);
+            line = arena.data;
+            end = arena.data + arena.used;
+            while (line < end && (code == OK || code == END_OF_STREAM)) {
+                count = (char *)memchr(line, '\n', end - line) - line;
+                if (print_line(matches, line, count) != OK) code = STREAM_WRITE_ERROR;
+                line += count + 1;
+            }
+            free_arena(&arena);
+            return code;
+        }
+        case AGGREGATE_SUM:
+        case AGGREGATE_MIN:
+        case AGGREGATE_MAX: {
+            if (stream->pos[0] != '-' && (stream->pos[0] < '0' || stream->pos[0] > '9')) {
+                return skip_value(stream);
+            }
+            code = read_number(stream, &value);
+            if (code != OK && code != END_OF_STREAM) return code;
+            if (matches->numbers++ == 0) matches->total = value;
+            else if (matches->aggregate == AGGREGATE_SUM) matches->total += value;
+            else if (matches->aggregate == AGGREGATE_MIN && value < matches->total) matches->total = value;
+            else if (matches->aggregate == AGGREGATE_MAX && value > matches->total) matches->total = value;
+            return code;
+        }
+        default: return skip_value(stream);
+    }
+}
+
+/**
+ *  Print the result of an aggregate over all matches.
+ */
+
+static int report_total(struct matches_t *matches) {
+    char text[24];
+
+    switch (matches->aggregate) {
+        case AGGREGATE_COUNT: {
+            snprintf(text, sizeof(text), "%ld", matches->count);
+            return print_line(matches, text, strlen(text));
+        }
+        case AGGREGATE_SUM: {
+            return print_number(matches, (matches->numbers > 0) ? matches->total : 0.0);
+        }
+        case AGGREGATE_MIN:
+        case AGGREGATE_MAX: {
+            if (matches->numbers == 0) return OK;
+            return print_number(matches, matches->total);
+        }
+        default: return OK;
+    }
+}
+
+/**
+ *  Run the path over a stream, sending matches (or their aggregate) to out.
+ *  With a prefix, every match goes on its own line after the prefix;
+ *  otherwise a lone match is piped as is.
+ *
+ *  Returns OK if anything matched, END_OF_STREAM if nothing did, or an error
+ *  code.
+ */
+
+static int query(struct json_stream_t *stream, const struct options_t *options, struct output_t *out, const char *prefix) {
+    const char *path = options->path;
+    struct matches_t matches;
+    match_fn fn;
+    int code;
+
+    matches.out = out;
+    matches.aggregate = options->aggregate;
+    matches.count = 0;
+    matches.numbers = 0;
+    matches.total = 0.0;
+    matches.prefix = prefix;
+    fn = (options->aggregate == NO_AGGREGATE) ? pipe_match : reduce_match;
+
+    if (path_walks(path)) {
+        // Recursive and wildcard paths match many times. One match per
+        // line, as found.
+        code = walk_value(stream, path, fn, &matches);
+        // The stream ending right after the walked value is fine.
+        if (code != OK && code != END_OF_STREAM) return code;
+        if (report_total(&matches) != OK) return STREAM_WRITE_ERROR;
+        return (matches.count > 0) ? OK : END_OF_STREAM;
+    }
+
+    // Same as scan_value() unless the path has negative indices.
+    path = scan_tail(stream, path);
+    if (path == NULL) {
+        // Error bomb.
+        return stream->code;
+    }
+    if (path[0] != '\0') {
+        // Successful scan, no match.
+        if (report_total(&matches) != OK) return STREAM_WRITE_ERROR;
+        return END_OF_STREAM;
+    }
+
+    // Match! Let's pipe (or reduce).
+    if (options->aggregate != NO_AGGREGATE) {
+        code = reduce_match(stream, &matches);
+        if (code != OK && code != END_OF_STREAM) return code;
+        if (report_total(&matches) != OK) return STREAM_WRITE_ERROR;
+        return OK;
+    }
+    if (prefix != NULL) {
+        code = pipe_match(stream, &matches);
+        return (code == END_OF_STREAM) ? OK : code;
+    }
+    if (transfer_value(stream, out) != OK) {
+        return stream->code;
+    }
+    return OK;
+}
+
+
+/**
+ *  Shared by the workers of a batch run.
+ */
+
+struct batch_t {
+    const struct options_t *options;
+    const char **files;
+    long nfiles;
+
+    /**
+     *  Index of the next file to query.
+     */
+
+    long next;
+
+    /**
+     *  Index of the file whose results are written next. Workers wait their
+     *  turn, which keeps the output in the order the files were given.
+     */
+
+    long turn;
+
+    /**
+     *  Something matched somewhere.
+     */
+
+    int matched;
+
+    /**
+     *  Code of the first file (in order) that failed, or OK.
+     */
+
+    int error;
+
+#ifndef JVNOTHREADS
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+};
+
+/**
+ *  Query files from the batch until there are none left. Each worker reuses
+ *  one stream and one arena for all of its files.
+ */
+
+static void *batch_worker(void *arg) {
+    struct batch_t *batch = (struct batch_t *)arg;
+    struct json_stream_t stream;
+    struct arena_t arena;
+    struct output_t out;
     FILE *fp;
+    long i;
+    int opened;
+    int code;
+
+    init_arena(&arena);
+
+    while (1) {
+#ifndef JVNOTHREADS
+        pthread_mutex_lock(&batch->lock);
+#endif
+        i = batch->next++;
+#ifndef JVNOTHREADS
+        pthread_mutex_unlock(&batch->lock);
+#endif
+        if (i >= batch->nfiles) break;
+
+        reset_arena(&arena);
+        init_arena_output(&out, &arena);
+        out.indent = batch->options->indent;
+
+        fp = fopen(batch->files[i], "r");
+        opened = (fp != NULL);
+        if (!opened) {
+            code = STREAM_READ_ERROR;
+        }
+        else {
+            code = init_stream(&stream, fp);
+            if (code == OK) {
+                code = query(&stream, batch->options, &out, batch->files[i]);
+            }
+            fclose(fp);
+        }
+
+#ifndef JVNOTHREADS
+        pthread_mutex_lock(&batch->lock);
+        while (batch->turn != i) pthread_cond_wait(&batch->cond, &batch->lock);
+#endif
+        if (arena.used > 0) fwrite(arena.data, JVBYTE, arena.used, stdout);
+        if (!opened) {
+            fprintf(stderr, "Error opening file %s.\n", batch->files[i]);
+        }
+        if (code == OK) batch->matched = 1;
+        else if (code != END_OF_STREAM && batch->error == OK) {
+            batch->error = code;
+        }
+        batch->turn++;
+#ifndef JVNOTHREADS
+        pthread_cond_broadcast(&batch->cond);
+        pthread_mutex_unlock(&batch->lock);
+#endif
+    }
+
+    free_arena(&arena);
+    return NULL;
+}
+
+/**
+ *  Query many files with a pool of workers. Results come out in file order,
+ *  each line prefixed by the file name.
+ *
+ *  Returns the code of the first file that failed, else OK if anything
+ *  matched, else END_OF_STREAM.
+ */
+
+static int run_batch(const struct options_t *options, const char **files, long nfiles, int jobs) {
+    struct batch_t batch;
+#ifndef JVNOTHREADS
+    pthread_t *threads;
+    int started;
+    int i;
+#endif
+
+    batch.options = options;
+    batch.files = files;
+    batch.nfiles = nfiles;
+    batch.next = 0;
+    batch.turn = 0;
+    batch.matched = 0;
+    batch.error = OK;
+
+#ifndef JVNOTHREADS
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.cond, NULL);
+
+    // The main thread is one of the workers.
+    if (jobs > nfiles) jobs = (int)nfiles;
+    started = 0;
+    threads = (jobs > 1) ? (pthread_t *)malloc((jobs - 1) * sizeof(pthread_t)) : NULL;
+    if (threads != NULL) {
+        for (i = 0; i < jobs - 1; i++) {
+            if (pthread_create(&threads[i], NULL, batch_worker, &batch) != 0) break;
+            started++;
+        }
+    }
+    batch_worker(&batch);
+    for (i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+    free(threads);
+    pthread_cond_destroy(&batch.cond);
+    pthread_mutex_destroy(&batch.lock);
+#else
+    (void)jobs;
+    batch_worker(&batch);
+#endif
+
+    if (batch.error != OK) return batch.error;
+    return batch.matched ? OK : END_OF_STREAM;
+}
+
+/**
+ *  Run the path over one document of a sequence. Matches and aggregates are
+ *  printed one per line, as for recursive paths.
+ *
+ *  Returns as walk_value() does; matched is set if anything matched.
+ */
+
+static int query_document(struct json_stream_t *stream, const struct options_t *options, struct output_t *out, int *matched) {
+    struct matches_t matches;
+    int code;
+
+    matches.out = out;
+    matches.aggregate = options->aggregate;
+    matches.count = 0;
+    matches.numbers = 0;
+    matches.total = 0.0;
+    matches.prefix = NULL;
+
+    code = walk_value(stream, options->path,
+            (options->aggregate == NO_AGGREGATE) ? pipe_match : reduce_match, &matches);
+    if (code != OK && code != END_OF_STREAM) return code;
+    if (report_total(&matches) != OK) return STREAM_WRITE_ERROR;
+    if (matches.count > 0) *matched = 1;
+    return code;
+}
+
+/**
+ *  Move the stream to the first character of the next document.
+ */
+
+static int next_document(struct json_stream_t *stream) {
+    if (stream->pos[0] != '\0' && strchr(VALUE_TIPS, stream->pos[0]) != NULL) {
+        return OK;
+    }
+    return search(stream, VALUE_TIPS, NULL);
+}
+
+/**
+ *  Offset saved in a state file, or 0 if there is none.
+ */
+
+static long load_state(const char *name) {
+    FILE *fp;
+    long offset = 0;
+
+    if (name == NULL) return 0;
+    fp = fopen(name, "r");
+    if (fp == NULL) return 0;
+    if (fscanf(fp, "%ld", &offset) != 1 || offset < 0) offset = 0;
+    fclose(fp);
+    return offset;
+}
+
+/**
+ *  Replace the state file with a new offset. The file is written aside and
+ *  renamed over the old one, so it is never seen half written.
+ */
+
+static int save_state(const char *name, long offset) {
+    char temp[JVPATHMAX];
+    FILE *fp;
+
+    if (name == NULL) return OK;
+    snprintf(temp, sizeof(temp), "%s.tmp", name);
+    fp = fopen(temp, "w");
+    if (fp == NULL) return WRITE_ERROR;
+    fprintf(fp, "%ld\n", offset);
+    if (fclose(fp) != 0 || rename(temp, name) != 0) return WRITE_ERROR;
+    return OK;
+}
+
+/**
+ *  Block until the size of the file is no longer size, and return the new
+ *  size (smaller if the file was truncated). Waits on inotify when it can,
+ *  and otherwise checks every JVWAIT milliseconds.
+ */
+
+static long wait_for_change(FILE *fp, const char *name, long size) {
+    struct stat st;
+    struct timespec nap;
+#ifdef __linux__
+    static int watch = -2;
+    struct pollfd pfd;
+    struct iovec iov;
+    char events[4096];
+
+    if (watch == -2) {
+        watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watch >= 0 && inotify_add_watch(watch, name, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE) < 0) {
+            watch = -1;
+        }
+    }
+#else
+    (void)name;
+#endif
+
+    while (1) {
+        if (fstat(fileno(fp), &st) != 0) return -1;
+        if ((long)st.st_size != size) return (long)st.st_size;
+
+#ifdef __linux__
+        if (watch >= 0) {
+            pfd.fd = watch;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, JVWAIT) > 0) {
+                // Drain the events; fstat tells us what we need.
+                iov.iov_base = events;
+                iov.iov_len = sizeof(events);
+                while (readv(watch, &iov, 1) > 0);
+            }
+            continue;
+        }
+#endif
+        nap.tv_sec = JVWAIT / 1000;
+        nap.tv_nsec = (JVWAIT % 1000) * 1000000L;
+        nanosleep(&nap, NULL);
+    }
+}
+
+/**
+ *  Query every document of an NDJSON source. Output for a document is only
+ *  written once the document is complete. With --follow, a document cut
+ *  off by the end of the file is read again from its start once the file
+ *  grows, and jv never exits on its own; with --state, it is left for the
+ *  next run.
+ *
+ *  Returns OK if anything matched, END_OF_STREAM if nothing did, or an error
+ *  code.
+ */
+
+static int query_lines(FILE *fp, const char *name, const struct options_t *options) {
+    struct json_stream_t stream;
+    struct arena_t arena;
+    struct output_t out;
+    struct stat st;
+    size_t mark;
+    long start;
+    long saved;
+    long size;
+    int matched = 0;
+    int code;
+
+    init_arena(&arena);
+    init_arena_output(&out, &arena);
+    out.indent = options->indent;
+    out.encoding = options->encoding;
+
+    // Resume where the last run left off, unless the file has since shrunk.
+    start = load_state(options->state);
+    if (start > 0 && (fstat(fileno(fp), &st) != 0 || (long)st.st_size < start ||
+            fseek(fp, start, SEEK_SET) != 0)) {
+        start = 0;
+        rewind(fp);
+    }
+    saved = start;
+    code = init_stream(&stream, fp);
+    stream.follow = options->follow;
+
+    while (1) {
+        if (code == OK) code = next_document(&stream);
+        if (code == OK) {
+            mark = arena.used;
+            code = query_document(&stream, options, &out, &matched);
+            if (code == OK) {
+                // Complete; the next document starts here (or later).
+                start = stream_offset(&stream);
+                if (arena.used >= JVFLUSH) {
+                    fwrite(arena.data, JVBYTE, arena.used, stdout);
+                    reset_arena(&arena);
+                }
+                continue;
+            }
+            if (code != END_OF_STREAM) break;
+
+            // The document ran into the end of the input. It may be whole,
+            // but when it can be read again later, wait for its newline.
+            if (options->follow || options->state != NULL) arena.used = mark;
+        }
+        else if (code != END_OF_STREAM) break;
+
+        // Dry. Hand over everything complete so far.
+        if (arena.used > 0) fwrite(arena.data, JVBYTE, arena.used, stdout);
+        reset_arena(&arena);
+        if (fflush(stdout) != 0) {
+            code = STREAM_WRITE_ERROR;
+            break;
+        }
+        if (start != saved) {
+            code = save_state(options->state, start);
+            if (code != OK) break;
+            saved = start;
+        }
+        if (!options->follow) {
+            code = matched ? OK : END_OF_STREAM;
+            break;
+        }
+
+        size = wait_for_change(fp, name, stream.offset + (long)strlen(stream.buffer));
+        if (size < 0) {
+            code = STREAM_READ_ERROR;
+            break;
+        }
+        if (size < start) {
+            // Truncated, as by copytruncate log rotation. Start over.
+            start = 0;
+        }
+        code = seek_stream(&stream, start);
+    }
+
+    free_arena(&arena);
+    return code;
+}
+
+/**
+ *  Stream the elements of the array at the path into shard files, one
+ *  compacted element per line. Elements are dealt round-robin or, with
+ *  --balance, to whichever shard has received the fewest input bytes. Inner
+ *  structure is passed over by the collection skipper as it is copied.
+ *
+ *  Returns OK if the array was split, END_OF_STREAM if there was no array at
+ *  the path, or an error code.
+ */
+
+static int split_array(struct json_stream_t *stream, const struct options_t *options) {
+    char name[JVPATHMAX];
+    struct output_t *shards;
+    char *buffers;
+    long *sizes;
+    const char *path;
+    long start;
+    long count = 0;
+    int shard = 0;
+    int opened = 0;
+    int code;
+    int i;
+
+    shards = (struct output_t *)malloc(options->shards * sizeof(struct output_t));
+    sizes = (long *)calloc(options->shards, sizeof(long));
+    buffers = (char *)malloc((size_t)options->shards * JVSHARDBUF);
+    code = (shards == NULL || sizes == NULL || buffers == NULL) ? OUT_OF_MEMORY : OK;
+
+    if (code == OK) code = next_document(stream);
+    if (code == OK) {
+        path = scan_tail(stream, options->path);
+        if (path == NULL) code = stream->code;
+        else if (path[0] != '\0' || stream->pos[0] != '[') code = END_OF_STREAM;
+    }
+
+    // Nothing is created unless there is an array to split.
+    if (code == OK && mkdir(options->outdir, 0777) != 0 && errno != EEXIST) code = WRITE_ERROR;
+    for (i = 0; i < options->shards && code == OK; i++) {
+        snprintf(name, sizeof(name), "%s/part-%05d.ndjson", options->outdir, i);
+        init_output(&shards[i], fopen(name, "w"), NULL, 0);
+        if (shards[i].fp == NULL) {
+            fprintf(stderr, "Error opening file %s.\n", name);
+            code = WRITE_ERROR;
+            break;
+        }
+        setvbuf(shards[i].fp, buffers + (size_t)i * JVSHARDBUF, _IOFBF, JVSHARDBUF);
+        shards[i].indent = 0;
+        opened++;
+    }
+    if (code == OK) code = search(stream, ELEMENT_TIPS, NULL);
+
+    while (code == OK && stream->pos[0] != ']') {
+        if (options->balance) {
+            for (i = 1, shard = 0; i < options->shards; i++) {
+                if (sizes[i] < sizes[shard]) shard = i;
+            }
+        }
+        else {
+            shard = (int)(count % options->shards);
+        }
+
+        start = stream_offset(stream);
+        code = pipe_json(stream, &shards[shard]);
+        if (code != OK && code != END_OF_STREAM) break;
+        if (capture("\n", 1, &shards[shard]) != OK) code = WRITE_ERROR;
+        if (code != OK) break;
+        sizes[shard] += stream_offset(stream) - start;
+        count++;
+
+        if (stream->pos[0] != ']') code = search(stream, ELEMENT_TIPS, NULL);
+    }
+
+    for (i = 0; i < opened; i++) {
+        if (fclose(shards[i].fp) != 0 && code == OK) code = WRITE_ERROR;
+    }
+    // The files are closed; their buffers can go.
+    free(buffers);
+    free(shards);
+    free(sizes);
+    return code;
+}
+
+/**
+ *  Column types of the --columns format. The numbers are part of the file
+ *  format.
+ */
+
+enum column_type_t {
+    COLUMN_INT64 = 1,
+    COLUMN_DOUBLE = 2,
+    COLUMN_STRING = 3,
+    COLUMN_BOOL = 4
+};
+
+/**
+ *  One projected column and the buffers of its current batch.
+ */
+
+struct column_t {
+    const char *path;
+    const char *name;
+    enum column_type_t type;
+
+    /**
+     *  One bit per row, set if the row has a value (least significant bit
+     *  first).
+     */
+
+    struct arena_t validity;
+
+    /**
+     *  Fixed-width values, or for strings, the UTF-8 bytes of all values.
+     */
+
+    struct arena_t values;
+
+    /**
+     *  For strings: where each row's bytes start in values, and where the
+     *  last one ends.
+     */
+
+    struct arena_t offsets;
+
+    /**
+     *  The current row's value, until the row is done. Only the first match
+     *  of the path counts.
+     */
+
+    int found;
+    int valid;
+    int64_t whole;
+    double real;
+};
+
+/**
+ *  State of a --columns run.
+ */
+
+struct table_t {
+    struct column_t *columns;
+    int ncolumns;
+    long rows;
+    long total;
+
+    /**
+     *  The column paths, in column order, for walk_paths().
+     */
+
+    const char **paths;
+
+    /**
+     *  Text of the cell at hand, for numbers and strings that need it.
+     */
+
+    struct arena_t cell;
+};
+
+/**
+ *  Append an unsigned integer of the given width, little-endian.
+ */
+
+static int put_le(struct arena_t *arena, uint64_t value, int width) {
+    char bytes[8];
+    int i;
+
+    for (i = 0; i < width; i++) {
+        bytes[i] = (char)(value >> (8 * i));
+    }
+    return arena_append(arena, bytes, width);
+}
+
+/**
+ *  Split a --columns spec, "path:type,path:type,...", in place. Commas and
+ *  colons inside bracketed names do not count.
+ */
+
+static int parse_columns(char *spec, struct table_t *table) {
+    struct column_t *column;
+    char *chp;
+    char *colon = NULL;
+    int quoted = 0;
+    int size = 8;
+
+    table->ncolumns = 0;
+    table->columns = (struct column_t *)malloc(size * sizeof(struct column_t));
+    if (table->columns == NULL) return OUT_OF_MEMORY;
+
+    for (chp = spec; ; chp++) {
+        if (!quoted && chp[0] == '[' && chp[1] == '"') quoted = 1;
+        else if (quoted && chp[0] == '"' && chp[-1] != '\\' && chp[1] == ']') quoted = 0;
+        if (quoted) continue;
+        if (chp[0] == ':') colon = chp;
+        if (chp[0] != ',' && chp[0] != '\0') continue;
+
+        if (colon == NULL) return BAD_PATH_STRING;
+        if (table->ncolumns == size) {
+            size *= 2;
+            column = (struct column_t *)realloc(table->columns, size * sizeof(struct column_t));
+            if (column == NULL) return OUT_OF_MEMORY;
+            table->columns = column;
+        }
+        column = &table->columns[table->ncolumns++];
+        column->path = column->name = spec;
+        *colon = '\0';
+        if (strncmp(colon + 1, "int64", chp - colon - 1) == 0 && chp - colon - 1 == 5) column->type = COLUMN_INT64;
+        else if (strncmp(colon + 1, "double", chp - colon - 1) == 0 && chp - colon - 1 == 6) column->type = COLUMN_DOUBLE;
+        else if (strncmp(colon + 1, "string", chp - colon - 1) == 0 && chp - colon - 1 == 6) column->type = COLUMN_STRING;
+        else if (strncmp(colon + 1, "bool", chp - colon - 1) == 0 && chp - colon - 1 == 4) column->type = COLUMN_BOOL;
+        else return BAD_PATH_STRING;
+        init_arena(&column->validity);
+        init_arena(&column->values);
+        init_arena(&column->offsets);
+
+        if (chp[0] == '\0') break;
+        spec = chp + 1;
+        colon = NULL;
+    }
+    return OK;
+}
+
+/**
+ *  Write the rows gathered so far as one batch, and start the next.
+ *
+ *      uint32 rows
+ *      per column:
+ *          validity    (rows + 7) / 8 bytes
+ *          int64       rows * 8 bytes      (two's complement)
+ *          double      rows * 8 bytes      (IEEE 754)
+ *          bool        rows bytes          (0 or 1)
+ *          string      (rows + 1) uint32 offsets, then the bytes
+ *
+ *  Everything is little-endian. Null values are zero (or empty).
+ */
+
+static int write_batch(struct table_t *table) {
+    struct column_t *column;
+    char count[4];
+    int i;
+
+    for (i = 0; i < 4; i++) count[i] = (char)(table->rows >> (8 * i));
+    if (fwrite(count, 1, 4, stdout) != 4) return STREAM_WRITE_ERROR;
+
+    // The empty batch at the end is just its count.
+    for (i = 0; i < table->ncolumns && table->rows > 0; i++) {
+        column = &table->columns[i];
+        if (column->type == COLUMN_STRING) {
+            if (put_le(&column->offsets, column->values.used, 4) != OK) return OUT_OF_MEMORY;
+        }
+        if (fwrite(column->validity.data, 1, column->validity.used, stdout) != column->validity.used ||
+                fwrite(column->offsets.data, 1, column->offsets.used, stdout) != column->offsets.used ||
+                fwrite(column->values.data, 1, column->values.used, stdout) != column->values.used) {
+            return STREAM_WRITE_ERROR;
+        }
+        reset_arena(&column->validity);
+        reset_arena(&column->offsets);
+        reset_arena(&column->values);
+    }
+
+    table->total += table->rows;
+    table->rows = 0;
+    return OK;
+}
+
+/**
+ *  Walk callback of a --columns row: take the value matched by the path of
+ *  column which as its cell, if its JSON type fits the column's. Anything
+ *  else is null.
+ */
+
+static int column_cell(struct json_stream_t *stream, int which, void *data) {
+    struct table_t *table = (struct table_t *)data;
+    struct column_t *column = &table->columns[which];
+    struct output_t out;
+    struct output_t text;
+    const char *end;
+    char kind = stream->pos[0];
+    int code;
+
+    if (column->found) return skip_value(stream);
+    column->found = 1;
+
+    switch (column->type) {
+        case COLUMN_BOOL: {
+            if (kind != 't' && kind != 'f') break;
+            column->valid = 1;
+            column->whole = (kind == 't');
+            break;
+        }
+        case COLUMN_STRING: {
+            if (kind == 'n') break;
+            column->valid = 1;
+            // Strings are decoded; anything else is kept as JSON text.
+            init_arena_output(&out, &column->values);
+            if (kind != '"') return pipe_json(stream, &out);
+            reset_arena(&table->cell);
+            init_arena_output(&text, &table->cell);
+            code = slice_value(stream, &text);
+            if (code != OK && code != END_OF_STREAM) return code;
+            if (unescape_string(text.slice, text.slice_len, &out) != OK) return OUT_OF_MEMORY;
+            return code;
+        }
+        default: {
+            if (kind != '-' && (kind < '0' || kind > '9')) break;
+            reset_arena(&table->cell);
+            init_arena_output(&text, &table->cell);
+            code = slice_value(stream, &text);
+            if (code != OK && code != END_OF_STREAM) return code;
+            if (text.slice != table->cell.data) {
+                // Still in the buffer. Copy it out to end it.
+                reset_arena(&table->cell);
+                if (arena_append(&table->cell, text.slice, text.slice_len) != OK) return OUT_OF_MEMORY;
+            }
+
+            // An int64 must be whole and fit: 1.9 or 1e30 is null.
+            column->valid = 1;
+            errno = 0;
+            column->whole = strtoll(table->cell.data, (char **)&end, 10);
+            if (errno == ERANGE) column->valid = (column->type != COLUMN_INT64);
+            column->real = strtod(table->cell.data, NULL);
+            if (end[0] == '.' || end[0] == 'e' || end[0] == 'E') {
+                if (column->real >= -9223372036854775808.0 && column->real < 9223372036854775808.0 &&
+                        (double)(int64_t)column->real == column->real) {
+                    column->whole = (int64_t)column->real;
+                }
+                else if (column->type == COLUMN_INT64) column->valid = 0;
+            }
+            return code;
+        }
+    }
+    return skip_value(stream);
+}
+
+/**
+ *  Match callback of a --columns run: take the value as a row. Its cells
+ *  are projected in one walk over it, for every column at once.
+ */
+
+static int column_match(struct json_stream_t *stream, void *data) {
+    struct table_t *table = (struct table_t *)data;
+    struct column_t *column;
+    uint64_t bits;
+    int code;
+    int put;
+    int i;
+
+    for (i = 0; i < table->ncolumns; i++) {
+        column = &table->columns[i];
+        column->found = column->valid = 0;
+        column->whole = 0;
+        column->real = 0.0;
+        if (column->type == COLUMN_STRING) {
+            if (put_le(&column->offsets, column->values.used, 4) != OK) return OUT_OF_MEMORY;
+        }
+    }
+
+    code = walk_paths(stream, table->paths, table->ncolumns, column_cell, table);
+    if (code != OK && code != END_OF_STREAM) return code;
+
+    for (i = 0; i < table->ncolumns; i++) {
+        column = &table->columns[i];
+        if (table->rows % 8 == 0) {
+            if (arena_append(&column->validity, "", 1) != OK) return OUT_OF_MEMORY;
+        }
+        if (column->valid) {
+            column->validity.data[column->validity.used - 1] |= (char)(1 << (table->rows % 8));
+        }
+
+        switch (column->type) {
+            case COLUMN_INT64: {
+                put = put_le(&column->values, column->valid ? (uint64_t)column->whole : 0, 8);
+                break;
+            }
+            case COLUMN_DOUBLE: {
+                memcpy(&bits, &column->real, 8);
+                put = put_le(&column->values, bits, 8);
+                break;
+            }
+            case COLUMN_BOOL: {
+                put = put_le(&column->values, column->whole, 1);
+                break;
+            }
+            default: put = OK;
+        }
+        if (put != OK) return put;
+    }
+
+    if (++table->rows == JVROWS && write_batch(table) != OK) return STREAM_WRITE_ERROR;
+    return code;
+}
+
+/**
+ *  Write the columns of every match of the path to stdout as a columnar
+ *  binary file:
+ *
+ *      "JVCOLS1\0"
+ *      uint32 columns
+ *      per column: uint8 type, uint32 name length, name
+ *      batches (see write_batch), the last one with 0 rows
+ *
+ *  Returns OK if anything matched, END_OF_STREAM if nothing did, or an error
+ *  code.
+ */
+
+static int write_columns(struct json_stream_t *stream, const struct options_t *options) {
+    struct table_t table;
+    struct arena_t header;
+    int code;
+    int i;
+
+    table.rows = table.total = 0;
+    table.paths = NULL;
+    init_arena(&table.cell);
+    init_arena(&header);
+    code = parse_columns(options->columns, &table);
+    if (code != OK) return code;
+    table.paths = (const char **)malloc(table.ncolumns * sizeof(*table.paths));
+    if (table.paths == NULL) return OUT_OF_MEMORY;
+    for (i = 0; i < table.ncolumns; i++) table.paths[i] = table.columns[i].path;
+
+    arena_append(&header, "JVCOLS1", 8);
+    put_le(&header, table.ncolumns, 4);
+    for (i = 0; i < table.ncolumns; i++) {
+        put_le(&header, table.columns[i].type, 1);
+        put_le(&header, strlen(table.columns[i].name), 4);
+        code = arena_append(&header, table.columns[i].name, strlen(table.columns[i].name));
+    }
+    if (code != OK || fwrite(header.data, 1, header.used, stdout) != header.used) {
+        return STREAM_WRITE_ERROR;
+    }
+
+    code = next_document(stream);
+    if (code == OK) code = walk_value(stream, options->path, column_match, &table);
+    if (code == OK || code == END_OF_STREAM) {
+        // The rows left over, then an empty batch to end the file.
+        code = (table.total + table.rows > 0) ? OK : END_OF_STREAM;
+        if (table.rows > 0 && write_batch(&table) != OK) code = STREAM_WRITE_ERROR;
+        if (write_batch(&table) != OK) code = STREAM_WRITE_ERROR;
+    }
+
+    for (i = 0; i < table.ncolumns; i++) {
+        free_arena(&table.columns[i].validity);
+        free_arena(&table.columns[i].values);
+        free_arena(&table.columns[i].offsets);
+    }
+    free(table.columns);
+    free(table.paths);
+    free_arena(&table.cell);
+    free_arena(&header);
+    return code;
+}
+
+/**
+ *  Kinds of values counted by --schema, in the order they are reported.
+ */
+
+static const char *SHAPE_TYPES[] = {"object", "array", "string", "number", "boolean", "null"};
+
+#define JVSHAPETYPES 6
+
+/**
+ *  Statistics of one path pattern seen by --schema. Patterns form a tree:
+ *  each one is its parent's pattern plus a name, such as ".id", "[*]" or
+ *  ["a b"].
+ */
+
+struct shape_t {
+    long parent;
+    size_t name;
+    size_t name_len;
+
+    long count;
+    long types[JVSHAPETYPES];
+
+    /**
+     *  Range of string lengths (in bytes, as written), numbers, and array
+     *  lengths.
+     */
+
+    long min_len;
+    long max_len;
+    double min;
+    double max;
+    long min_items;
+    long max_items;
+};
+
+/**
+ *  All patterns seen so far, in the order they were first seen, with a hash
+ *  table from (parent, name) to pattern.
+ */
+
+struct schema_t {
+    struct shape_t *shapes;
+    long nshapes;
+    long size;
+
+    long *slots;
+    long nslots;
+
+    /**
+     *  Names of all patterns, and the name being read.
+     */
+
+    struct arena_t names;
+    struct arena_t key;
+};
+
+static unsigned long hash_shape(long parent, const char *name, size_t len) {
+    unsigned long hash = 2166136261UL ^ (unsigned long)parent;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619UL;
+    }
+    return hash;
+}
+
+/**
+ *  Index of the pattern for name under parent, added if new; -1 if out of
+ *  memory.
+ */
+
+static long find_shape(struct schema_t *schema, long parent, const char *name, size_t len) {
+    struct shape_t *shape;
+    long *slots;
+    long slot;
+    long i;
+
+    if (2 * (schema->nshapes + 1) > schema->nslots) {
+        // Grow the table and put everything back.
+        slots = (long *)malloc(2 * (schema->nslots + 32) * sizeof(long));
+        if (slots == NULL) return -1;
+        free(schema->slots);
+        schema->slots = slots;
+        schema->nslots = 2 * (schema->nslots + 32);
+        for (i = 0; i < schema->nslots; i++) schema->slots[i] = -1;
+        for (i = 0; i < schema->nshapes; i++) {
+            shape = &schema->shapes[i];
+            slot = hash_shape(shape->parent, schema->names.data + shape->name, shape->name_len) % schema->nslots;
+            while (schema->slots[slot] >= 0) slot = (slot + 1) % schema->nslots;
+            schema->slots[slot] = i;
+        }
+    }
+
+    slot = hash_shape(parent, name, len) % schema->nslots;
+    while ((i = schema->slots[slot]) >= 0) {
+        shape = &schema->shapes[i];
+        if (shape->parent == parent && shape->name_len == len &&
+                memcmp(schema->names.data + shape->name, name, len) == 0) {
+            return i;
+        }
+        slot = (slot + 1) % schema->nslots;
+    }
+
+    if (schema->nshapes == schema->size) {
+        schema->size = (schema->size > 0) ? schema->size * 2 : 64;
+        shape = (struct shape_t *)realloc(schema->shapes, schema->size * sizeof(struct shape_t));
+        if (shape == NULL) return -1;
+        schema->shapes = shape;
+    }
+    i = schema->nshapes++;
+    shape = &schema->shapes[i];
+    memset(shape, 0, sizeof(struct shape_t));
+    shape->parent = parent;
+    shape->name = schema->names.used;
+    shape->name_len = len;
+    if (arena_append(&schema->names, name, len) != OK) return -1;
+    schema->slots[slot] = i;
+    return i;
+}
+
+/**
+ *  Name of an object key in a path: .key, or ["key"] if it would not read
+ *  back as a plain name.
+ */
+
+static int key_name(struct arena_t *key, struct arena_t *name) {
+    const char *chp = key->data;
+    size_t len = key->used;
+
+    reset_arena(name);
+    if (len > 0 && strcspn(chp, ".[]\"\\ ") >= len) {
+        if (arena_append(name, ".", 1) != OK) return OUT_OF_MEMORY;
+        return arena_append(name, chp, len);
+    }
+    if (arena_append(name, "[\"", 2) != OK) return OUT_OF_MEMORY;
+    if (arena_append(name, chp, len) != OK) return OUT_OF_MEMORY;
+    return arena_append(name, "\"]", 2);
+}
+
+/**
+ *  Profile the value at the stream into the given pattern, and everything
+ *  inside it into the patterns below. Strings and numbers are measured
+ *  where they lie; nothing is captured but object keys.
+ */
+
+static int profile_value(struct json_stream_t *stream, struct schema_t *schema, long index) {
+    struct shape_t *shape = &schema->shapes[index];
+    struct output_t out;
+    struct arena_t name;
+    double value;
+    long start;
+    long items;
+    long child;
+    int type;
+    int code;
+
+    switch (stream->pos[0]) {
+        case '{': type = 0; break;
+        case '[': type = 1; break;
+        case '"': type = 2; break;
+        case 't':
+        case 'f': type = 4; break;
+        case 'n': type = 5; break;
+        default: type = 3;
+    }
+    shape->count++;
+    shape->types[type]++;
+
+    switch (type) {
+        case 0: {
+            init_arena(&name);
+            code = search(stream, "\"}", NULL);
+            while (code == OK && stream->pos[0] != '}') {
+                // Read the key, NUL-terminated for key_name().
+                reset_arena(&schema->key);
+                init_arena_output(&out, &schema->key);
+                code = pipe_string(stream, &out);
+                if (code != OK) break;
+                if (arena_append(&schema->key, "", 1) != OK) code = OUT_OF_MEMORY;
+                schema->key.used--;
+                if (code == OK) code = key_name(&schema->key, &name);
+                if (code != OK) break;
+
+                child = find_shape(schema, index, name.data, name.used);
+                if (child < 0) code = OUT_OF_MEMORY;
+                if (code == OK) code = search(stream, VALUE_TIPS, NULL);
+                if (code == OK) code = profile_value(stream, schema, child);
+                if (code == OK && stream->pos[0] != '}') {
+                    code = search(stream, "\"}", NULL);
+                }
+            }
+            free_arena(&name);
+            if (code != OK) return stream->code = code;
+            return bump(stream, NULL);
+        }
+        case 1: {
+            items = 0;
+            child = find_shape(schema, index, "[*]", 3);
+            if (child < 0) return OUT_OF_MEMORY;
+            if (search(stream, ELEMENT_TIPS, NULL) != OK) return stream->code;
+            while (stream->pos[0] != ']') {
+                items++;
+                code = profile_value(stream, schema, child);
+                if (code != OK) return code;
+                if (stream->pos[0] != ']') {
+                    if (search(stream, ELEMENT_TIPS, NULL) != OK) return stream->code;
+                }
+            }
+            // The table may have moved while profiling the elements.
+            shape = &schema->shapes[index];
+            if (shape->types[1] == 1 || items < shape->min_items) shape->min_items = items;
+            if (shape->types[1] == 1 || items > shape->max_items) shape->max_items = items;
+            return bump(stream, NULL);
+        }
+        case 2: {
+            // Measured up to the closing quote, which may be the last
+            // character of the input.
+            start = stream_offset(stream);
+            if (bump(stream, NULL) != OK) return stream->code;
+            if (string_body(stream, NULL) != OK) return stream->code;
+            items = stream_offset(stream) - start - 1;
+            if (shape->types[2] == 1 || items < shape->min_len) shape->min_len = items;
+            if (shape->types[2] == 1 || items > shape->max_len) shape->max_len = items;
+            return bump(stream, NULL);
+        }
+        case 3: {
+            code = read_number(stream, &value);
+            if (code != OK && code != END_OF_STREAM) return code;
+            if (shape->types[3] == 1 || value < shape->min) shape->min = value;
+            if (shape->types[3] == 1 || value > shape->max) shape->max = value;
+            return code;
+        }
+        default: return skip_value(stream);
+    }
+}
+
+/**
+ *  Match callback of --schema: profile the match as the root pattern.
+ */
+
+static int profile_match(struct json_stream_t *stream, void *data) {
+    return profile_value(stream, (struct schema_t *)data, 0);
+}
+
+/**
+ *  Print the path of a pattern, escaped for a JSON string.
+ */
+
+static void print_path(struct schema_t *schema, long index) {
+    struct shape_t *shape = &schema->shapes[index];
+    const char *chp = schema->names.data + shape->name;
+    size_t i;
+
+    if (shape->parent >= 0) print_path(schema, shape->parent);
+    // A top-level key needs no leading dot.
+    if (shape->parent == 0 && schema->shapes[0].name_len == 0 && chp[0] == '.') {
+        chp++;
+    }
+    for (i = chp - (schema->names.data + shape->name); i < shape->name_len; i++, chp++) {
+        if (*chp == '"' || *chp == '\\') putchar('\\');
+        putchar(*chp);
+    }
+}
+
+/**
+ *  Print one line of JSON per pattern, in the order they were first seen.
+ */
+
+static void print_schema(struct schema_t *schema, int key_counts) {
+    struct shape_t *shape;
+    struct shape_t *child;
+    char low[32];
+    char high[32];
+    const char *sep;
+    long i;
+    long j;
+    int t;
+
+    for (i = 0; i < schema->nshapes; i++) {
+        shape = &schema->shapes[i];
+        // Items of arrays that were always empty were never seen.
+        if (i > 0 && shape->count == 0) continue;
+        printf("{\"path\": \"");
+        print_path(schema, i);
+        printf("\", \"count\": %ld, \"types\": {", shape->count);
+        for (t = 0, sep = ""; t < JVSHAPETYPES; t++) {
+            if (shape->types[t] == 0) continue;
+            printf("%s\"%s\": %ld", sep, SHAPE_TYPES[t], shape->types[t]);
+            sep = ", ";
+        }
+        printf("}");
+        if (shape->types[1] > 0) printf(", \"items\": [%ld, %ld]", shape->min_items, shape->max_items);
+        if (shape->types[2] > 0) printf(", \"length\": [%ld, %ld]", shape->min_len, shape->max_len);
+        if (shape->types[3] > 0) {
+            format_number(low, sizeof(low), shape->min);
+            format_number(high, sizeof(high), shape->max);
+            printf(", \"range\": [%s, %s]", low, high);
+        }
+        if (key_counts && shape->types[0] > 0) {
+            // Keys are the children named .key or ["key"].
+            printf(", \"keys\": {");
+            for (j = i + 1, sep = ""; j < schema->nshapes; j++) {
+                child = &schema->shapes[j];
+                if (child->parent != i || schema->names.data[child->name + 1] == '*') {
+                    continue;
+                }
+                if (schema->names.data[child->name] == '.') {
+                    printf("%s\"%.*s\": %ld", sep, (int)child->name_len - 1,
+                            schema->names.data + child->name + 1, child->count);
+                }
+                else {
+                    printf("%s\"%.*s\": %ld", sep, (int)child->name_len - 4,
+                            schema->names.data + child->name + 2, child->count);
+                }
+                sep = ", ";
+            }
+            printf("}");
+        }
+        printf("}\n");
+    }
+}
+
+/**
+ *  Report the shape of every match of the path (of every document, with
+ *  --lines) in one pass.
+ *
+ *  Returns OK if anything matched, END_OF_STREAM if nothing did, or an error
+ *  code.
+ */
+
+static int profile(struct json_stream_t *stream, const struct options_t *options) {
+    struct schema_t schema;
     const char *path;
+    int code;
+
+    memset(&schema, 0, sizeof(schema));
+    init_arena(&schema.names);
+    init_arena(&schema.key);
+    // The root shape, for the path itself.
+    code = (find_shape(&schema, -1, options->path, strlen(options->path)) == 0) ? OK : OUT_OF_MEMORY;
+
+    while (code == OK) {
+        code = next_document(stream);
+        if (code != OK) break;
+        if (path_walks(options->path) || options->lines) {
+            code = walk_value(stream, options->path, profile_match, &schema);
+        }
+        else {
+            path = scan_tail(stream, options->path);
+            if (path == NULL) code = stream->code;
+            else if (path[0] == '\0') code = profile_match(stream, &schema);
+        }
+        if (!options->lines) break;
+    }
+
+    if (code == OK || code == END_OF_STREAM) {
+        print_schema(&schema, options->key_counts);
+        code = (schema.shapes[0].count > 0) ? OK : END_OF_STREAM;
+    }
+
+    free(schema.shapes);
+    free(schema.slots);
+    free_arena(&schema.names);
+    free_arena(&schema.key);
+    return code;
+}
+
+/**
+ *  Find the path in a stream. Returns OK if it matched, END_OF_STREAM if
+ *  not, or an error code.
+ */
+
+static int find_path(struct json_stream_t *stream, const char *path) {
+    if (next_document(stream) != OK) return stream->code;
+    path = scan_tail(stream, path);
+    if (path == NULL) return stream->code;
+    return (path[0] == '\0') ? OK : END_OF_STREAM;
+}
+
+/**
+ *  Diff the values at the path in two files. Where only one file has a
+ *  value there, it is reported whole.
+ *
+ *  Returns OK if the values are the same, VALUES_DIFFER if not (or if only
+ *  one file matched), END_OF_STREAM if neither file matched, or an error
+ *  code.
+ */
+
+static int diff_files(const char **files, const struct options_t *options) {
+    struct json_stream_t a;
+    struct json_stream_t b;
+    struct output_t out;
+    FILE *fa;
+    FILE *fb;
+    int found_a;
+    int found_b;
+    int code;
+
+    fa = fopen(files[0], "r");
+    fb = fopen(files[1], "r");
+    if (fa == NULL || fb == NULL) {
+        fprintf(stderr, "Error opening file %s.\n", files[(fa == NULL) ? 0 : 1]);
+        return 2;
+    }
+    if (init_stream(&a, fa) != OK || init_stream(&b, fb) != OK) {
+        fprintf(stderr, "Problem initializing stream.\n");
+        return 1;
+    }
+
+    found_a = find_path(&a, options->path);
+    if (found_a != OK && found_a != END_OF_STREAM) return found_a;
+    found_b = find_path(&b, options->path);
+    if (found_b != OK && found_b != END_OF_STREAM) return found_b;
+    if (found_a != OK && found_b != OK) return END_OF_STREAM;
+
+    // One line per difference.
+    init_output(&out, stdout, NULL, 0);
+    out.indent = 0;
+    code = diff_value((found_a == OK) ? &a : NULL, (found_b == OK) ? &b : NULL, options->path, &out);
+    return (code == END_OF_STREAM) ? OK : code;
+}
+
+/**
+ *  A uniform sample of the matches, kept with reservoir sampling
+ *  (Algorithm R): the first K matches fill the slots, and the n-th after
+ *  that replaces a random slot with probability K / n. Matches that do not
+ *  get a slot are skipped, not captured.
+ */
+
+struct sample_t {
+    struct output_t *out;
+    long size;
+    long seen;
+    uint64_t state;
+
+    /**
+     *  Per slot: the match, as it would be printed, and its position among
+     *  all matches.
+     */
+
+    struct arena_t *slots;
+    long *order;
+};
+
+/**
+ *  xorshift64*, good enough for picking slots and cheap.
+ */
+
+static uint64_t next_random(struct sample_t *sample) {
+    sample->state ^= sample->state >> 12;
+    sample->state ^= sample->state << 25;
+    sample->state ^= sample->state >> 27;
+    return sample->state * 0x2545F4914F6CDD1DULL;
+}
+
+static int sample_match(struct json_stream_t *stream, void *data) {
+    struct sample_t *sample = (struct sample_t *)data;
+    struct output_t out;
+    long slot;
+
+    slot = sample->seen++;
+    if (slot >= sample->size) {
+        slot = (long)(next_random(sample) % (uint64_t)sample->seen);
+        if (slot >= sample->size) return skip_value(stream);
+    }
+
+    // Capture as pipe_match() would print it.
+    reset_arena(&sample->slots[slot]);
+    init_arena_output(&out, &sample->slots[slot]);
+    out.indent = sample->out->indent;
+    out.encoding = sample->out->encoding;
+    sample->order[slot] = sample->seen - 1;
+    return pipe_value(stream, &out);
+}
+
+/**
+ *  A slot and its match's position, to sort the slots into input order.
+ */
+
+struct ranked_slot_t {
+    long order;
+    long slot;
+};
+
+static int compare_slots(const void *a, const void *b) {
+    long x = ((const struct ranked_slot_t *)a)->order;
+    long y = ((const struct ranked_slot_t *)b)->order;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ *  Print a sample of the matches, in the order they were found.
+ *
+ *  Returns OK if anything matched, END_OF_STREAM if nothing did, or an error
+ *  code.
+ */
+
+static int sample_matches(struct json_stream_t *stream, const struct options_t *options, struct output_t *out) {
+    struct sample_t sample;
+    struct ranked_slot_t *slots;
+    long kept;
+    long i;
+    int code;
+
+    sample.out = out;
+    sample.size = options->sample;
+    sample.seen = 0;
+    sample.state = options->seeded ? options->seed : (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32);
+    sample.state ^= 0x9E3779B97F4A7C15ULL;
+    if (sample.state == 0) sample.state = 1;
+    sample.slots = (struct arena_t *)malloc(sample.size * sizeof(struct arena_t));
+    sample.order = (long *)malloc(sample.size * sizeof(long));
+    slots = (struct ranked_slot_t *)malloc(sample.size * sizeof(struct ranked_slot_t));
+    if (sample.slots == NULL || sample.order == NULL || slots == NULL) return OUT_OF_MEMORY;
+    for (i = 0; i < sample.size; i++) init_arena(&sample.slots[i]);
+
+    do {
+        code = next_document(stream);
+        if (code != OK) break;
+        code = walk_value(stream, options->path, sample_match, &sample);
+    } while (options->lines && code == OK);
+
+    if (code == OK || code == END_OF_STREAM) {
+        kept = (sample.seen < sample.size) ? sample.seen : sample.size;
+        for (i = 0; i < kept; i++) {
+            slots[i].order = sample.order[i];
+            slots[i].slot = i;
+        }
+        qsort(slots, kept, sizeof(struct ranked_slot_t), compare_slots);
+        for (i = 0; i < kept; i++) {
+            if (capture(sample.slots[slots[i].slot].data, sample.slots[slots[i].slot].used, out) != OK ||
+                    (out->encoding == ENCODE_JSON && capture("\n", 1, out) != OK)) {
+                code = STREAM_WRITE_ERROR;
+                break;
+            }
+        }
+        if (i == kept) code = (sample.seen > 0) ? OK : END_OF_STREAM;
+    }
+
+    for (i = 0; i < sample.size; i++) free_arena(&sample.slots[i]);
+    free(sample.slots);
+    free(sample.order);
+    free(slots);
+    return code;
+}
+
+/**
+ *  Append the file names listed one per line in list_name ("-" for stdin) to
+ *  a growable array of names.
+ */
+
+static int read_file_list(const char *list_name, const char ***files, long *nfiles, long *size) {
+    char line[JVPATHMAX];
+    const char **grown;
+    char *name;
+    size_t len;
+    FILE *fp;
+
+    fp = (strcmp(list_name, "-") == 0) ? stdin : fopen(list_name, "r");
+    if (fp == NULL) return STREAM_READ_ERROR;
+
+    while (fgets(line, JVPATHMAX, fp) != NULL) {
+        len = strcspn(line, "\r\n");
+        if (len == 0) continue;
+        line[len] = '\0';
+
+        if (*nfiles == *size) {
+            *size = (*size > 0) ? *size * 2 : 64;
+            grown = (const char **)realloc(*files, *size * sizeof(char *));
+            if (grown == NULL) return OUT_OF_MEMORY;
+            *files = grown;
+        }
+        name = (char *)malloc(len + 1);
+        if (name == NULL) return OUT_OF_MEMORY;
+        memcpy(name, line, len + 1);
+        (*files)[(*nfiles)++] = name;
+    }
+
+    if (fp != stdin) fclose(fp);
+    return OK;
+}
+
+/**
+ *  Split a --set argument, path=<json>, at the first '=' outside a bracketed
+ *  name.
+ */
+
+static int split_assignment(char *arg, struct options_t *options) {
+    char *chp;
+    int quoted = 0;
+
+    for (chp = arg; *chp != '\0'; chp++) {
+        if (!quoted && chp[0] == '[' && chp[1] == '"') quoted = 1;
+        else if (quoted && chp[0] == '"' && chp[-1] != '\\' && chp[1] == ']') quoted = 0;
+        else if (!quoted && chp[0] == '=') {
+            *chp = '\0';
+            options->path = arg;
+            options->json = chp + 1;
+            return OK;
+        }
+    }
+    return BAD_PATH_STRING;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: jv [options] [<file>...] <attr>\n\n");
+    fprintf(stderr, "  For example: jv \"dogs[34].breed\" < animals.json\n\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --files-from <list>  Also query the files named in <list>, one per line.\n");
+    fprintf(stderr, "  -j, --jobs <n>       Query up to <n> files at once.\n");
+    fprintf(stderr, "  --compact            Print objects and arrays without whitespace.\n");
+    fprintf(stderr, "  --indent <n>         Pretty-print objects and arrays, <n> spaces per level.\n");
+    fprintf(stderr, "  --length             Print the number of members of each match.\n");
+    fprintf(stderr, "  --keys               Print the keys of each matched object.\n");
+    fprintf(stderr, "  --count              Print the number of matches.\n");
+    fprintf(stderr, "  --sum, --min, --max  Print the sum, minimum or maximum of the numbers matched.\n");
+    fprintf(stderr, "  --lines              Query every document of an NDJSON input.\n");
+    fprintf(stderr, "  --follow             With --lines, keep reading as the file grows.\n");
+    fprintf(stderr, "  --state <file>       With --lines, resume from (and save) an offset in <file>.\n");
+    fprintf(stderr, "  --set <attr>=<json>  Print the input with the value at <attr> replaced.\n");
+    fprintf(stderr, "  --delete <attr>      Print the input without the value at <attr>.\n");
+    fprintf(stderr, "  --split <attr>       Write the elements of the array at <attr> to NDJSON shards.\n");
+    fprintf(stderr, "  -n <n>               With --split, the number of shards (default 1).\n");
+    fprintf(stderr, "  -o <dir>             With --split, the directory for the shards (default .).\n");
+    fprintf(stderr, "  --balance            With --split, deal elements by size, not round-robin.\n");
+    fprintf(stderr, "  --columns <spec>     Write fields of each match as columnar binary, e.g.\n");
+    fprintf(stderr, "                       id:int64,name:string,area:double,ok:bool.\n");
+    fprintf(stderr, "  --schema             Report the shape of each match ('' for the whole document).\n");
+    fprintf(stderr, "  --key-counts         With --schema, also count the keys of objects.\n");
+    fprintf(stderr, "  --format <f>         Write matches as json (the default), cbor or msgpack.\n");
+    fprintf(stderr, "  --sample <k>         Print <k> matches picked at random, in input order.\n");
+    fprintf(stderr, "  --seed <s>           With --sample, seed the random choice with <s>.\n");
+    fprintf(stderr, "  --diff <a> <b>       Print what changed from file <a> to file <b>, as NDJSON\n");
+    fprintf(stderr, "                       (<attr> may be left out).\n\n");
+    exit(1);
+}
+
+
+int main(int argc, char **argv) {
+    FILE *fp;
+    struct options_t options;
+    const char **files;
+    long nfiles;
+    long size;
+    int batch;
+    int jobs;
+    int code;
+    int i;
     struct json_stream_t stream;
     struct output_t out;
 
-    if (argc == 2) {
+    // Everything that is not an option is a file, except the last one,
+    // which is the path. Files named on the command line come first.
+    size = argc;
+    files = (const char **)malloc(size * sizeof(char *));
+    if (files == NULL) exit(OUT_OF_MEMORY);
+    nfiles = 0;
+    batch = 0;
+    jobs = 0;
+    options.indent = JVRAW;
+    options.aggregate = NO_AGGREGATE;
+    options.lines = 0;
+    options.follow = 0;
+    options.state = NULL;
+    options.edit = 0;
+    options.json = NULL;
+    options.split = 0;
+    options.shards = 1;
+    options.outdir = ".";
+    options.balance = 0;
+    options.columns = NULL;
+    options.schema = 0;
+    options.key_counts = 0;
+    options.diff = 0;
+    options.encoding = ENCODE_JSON;
+    options.sample = 0;
+    options.seed = 0;
+    options.seeded = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--files-from") == 0 && i + 1 < argc) {
+            // Read after the loop, so the list follows the named files.
+            batch = i++;
+        }
+        else if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--compact") == 0) {
+            options.indent = 0;
+        }
+        else if (strcmp(argv[i], "--indent") == 0 && i + 1 < argc) {
+            options.indent = atoi(argv[++i]);
+            if (options.indent < 0) usage();
+        }
+        else if (strcmp(argv[i], "--length") == 0) options.aggregate = AGGREGATE_LENGTH;
+        else if (strcmp(argv[i], "--keys") == 0) options.aggregate = AGGREGATE_KEYS;
+        else if (strcmp(argv[i], "--count") == 0) options.aggregate = AGGREGATE_COUNT;
+        else if (strcmp(argv[i], "--sum") == 0) options.aggregate = AGGREGATE_SUM;
+        else if (strcmp(argv[i], "--min") == 0) options.aggregate = AGGREGATE_MIN;
+        else if (strcmp(argv[i], "--max") == 0) options.aggregate = AGGREGATE_MAX;
+        else if (strcmp(argv[i], "--lines") == 0) options.lines = 1;
+        else if (strcmp(argv[i], "--follow") == 0) options.follow = 1;
+        else if (strcmp(argv[i], "--state") == 0 && i + 1 < argc) options.state = argv[++i];
+        else if (strcmp(argv[i], "--set") == 0 && i + 1 < argc) {
+            options.edit = 1;
+            if (split_assignment(argv[++i], &options) != OK) usage();
+        }
+        else if (strcmp(argv[i], "--split") == 0 && i + 1 < argc) {
+            options.split = 1;
+            options.path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            options.shards = atoi(argv[++i]);
+            if (options.shards <= 0) usage();
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) options.outdir = argv[++i];
+        else if (strcmp(argv[i], "--balance") == 0) options.balance = 1;
+        else if (strcmp(argv[i], "--columns") == 0 && i + 1 < argc) options.columns = argv[++i];
+        else if (strcmp(argv[i], "--schema") == 0) options.schema = 1;
+        else if (strcmp(argv[i], "--key-counts") == 0) options.key_counts = 1;
+        else if (strcmp(argv[i], "--diff") == 0) options.diff = 1;
+        else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+            options.sample = atol(argv[++i]);
+            if (options.sample <= 0) usage();
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            options.seed = strtoull(argv[++i], NULL, 10);
+            options.seeded = 1;
+        }
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "json") == 0) options.encoding = ENCODE_JSON;
+            else if (strcmp(argv[i], "cbor") == 0) options.encoding = ENCODE_CBOR;
+            else if (strcmp(argv[i], "msgpack") == 0) options.encoding = ENCODE_MSGPACK;
+            else usage();
+        }
+        else if (strcmp(argv[i], "--delete") == 0 && i + 1 < argc) {
+            options.edit = 1;
+            options.path = argv[++i];
+            options.json = NULL;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            usage();
+        }
+        else {
+            files[nfiles++] = argv[i];
+        }
+    }
+    // Unless editing or splitting, where the path comes with the option.
+    if (!options.edit && !options.split) {
+        if (nfiles == 2 && options.diff) files[nfiles++] = "";
+        if (nfiles == 0) usage();
+        options.path = files[--nfiles];
+    }
+    if ((options.edit || options.split || options.columns != NULL) &&
+            (batch || nfiles > 1 || options.lines)) {
+        usage();
+    }
+
+    if (batch) {
+        code = read_file_list(argv[batch + 1], &files, &nfiles, &size);
+        if (code != OK) {
+            fprintf(stderr, "Error reading file list %s.\n", argv[batch + 1]);
+            exit(code);
+        }
+    }
+
+    // A sequence of documents comes from a single input, and following or
+    // resuming needs a file.
+    if ((options.follow || options.state != NULL) && !options.lines) usage();
+    if (options.lines && (batch || nfiles > 1)) usage();
+    if ((options.follow || options.state != NULL) && nfiles == 0) usage();
+    // Binary output is for plain queries, one input at a time.
+    if (options.encoding != ENCODE_JSON && (batch || nfiles > 1 || options.aggregate != NO_AGGREGATE ||
+            options.edit || options.split || options.columns != NULL || options.schema || options.diff)) {
+        usage();
+    }
+    // A seed is only for picking a sample.
+    if (options.seeded && !options.sample) usage();
+    // Both sides of a diff are files, to seek back into.
+    if (options.diff) {
+        if (nfiles != 2 || batch || options.lines || options.sample) usage();
+        if (path_walks(options.path)) usage();
+        exit(diff_files(files, &options));
+    }
+    // A schema or a sample is printed once, at the end of the input.
+    if ((options.schema || options.sample) &&
+            (batch || nfiles > 1 || options.follow || options.state != NULL)) {
+        usage();
+    }
+    if (options.sample && (options.aggregate != NO_AGGREGATE || options.edit || options.split ||
+            options.columns != NULL || options.schema)) {
+        usage();
+    }
+
+    if (batch || nfiles > 1) {
+        if (jobs <= 0) {
+#ifdef __linux__
+            jobs = get_nprocs();
+#else
+            jobs = 4;
+#endif
+        }
+        exit(run_batch(&options, files, nfiles, jobs));
+    }
+
+    if (nfiles == 0) {
         // Stream from stdin
         fp = stdin;
-        path = argv[1];
     }
-    else if (argc == 3) {
+    else {
         // Stream in a file.
-        fp = fopen(argv[1], "r");
+        fp = fopen(files[0], "r");
         if (fp == NULL) {
-            fprintf(stderr, "Error opening file %s.\n", argv[1]);
+            fprintf(stderr, "Error opening file %s.\n", files[0]);
             exit(2);
         }
-        path = argv[2];
     }
-    else {
-        fprintf(stderr, "Usage: jv [<file>] <attr>\n\n");
-        fprintf(stderr, "  For example: jv \"dogs[34].breed\" < animals.json\n\n");
-        exit(1);
+
+    if (options.lines && !options.schema && !options.sample) {
+        exit(query_lines(fp, (nfiles > 0) ? files[0] : NULL, &options));
     }
 
     if (init_stream(&stream, fp) != OK) {
@@ -31,21 +2035,23 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    path = scan_value(&stream, path);
-    if (path == NULL) {
-        // Error bomb. For now, just exit with code.
-        exit(stream.code);
+    init_output(&out, stdout, NULL, 0);
+    out.indent = options.indent;
+    out.encoding = options.encoding;
+    if (options.edit) {
+        exit(edit_value(&stream, options.path, options.json, &out));
     }
-    if (path[0] != '\0') {
-        // Successful scan, no match. Return nonzero code.
-        exit(END_OF_STREAM);
+    if (options.split) {
+        exit(split_array(&stream, &options));
     }
-
-    // Match! Let's pipe.
-    init_output(&out, stdout, NULL, 0);
-    if (pipe_value(&stream, &out) != OK) {
-        exit(stream.code);
+    if (options.columns != NULL) {
+        exit(write_columns(&stream, &options));
     }
-
-    exit(OK);
+    if (options.schema) {
+        exit(profile(&stream, &options));
+    }
+    if (options.sample) {
+        exit(sample_matches(&stream, &options, &out));
+    }
+    exit(query(&stream, &options, &out, NULL));
 }
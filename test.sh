@@ -2,10 +2,12 @@
 
 # Compile it
 #gcc -D JVDEBUG -o jv jv_cli.c
-gcc -D JVBUF=1 -o jv jv_cli.c
+gcc -D JVBUF=1 -pthread -o jv jv_cli.c
 #gcc -D JVBUF=1 -D JVDEBUG -o jv jv_cli.c
 
 ONLY=""
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
 
 # Run a test.
 #
@@ -24,6 +26,58 @@ function run {
     fi
 }
 
+# Same as run, with command line options (split on spaces) before the path.
+#
+#   format: runwith <test-name> <options> <json> <path> <expected-value>
+
+function runwith {
+    if [[ -z "$ONLY" || "$1" == "$ONLY" ]]; then
+        OUTPUT=$(printf "$3" | ./jv $2 "$4")
+        if [[ "$OUTPUT" != "$5" ]]; then
+            echo "$1 failed"
+            echo "  expected: $5"
+            echo "  output: $OUTPUT"
+            exit 1
+        fi
+        echo "$1 OK"
+    fi
+}
+
+# Edit the JSON with --set or --delete, which take the path themselves.
+#
+#   format: runedit <test-name> <option> <argument> <json> <expected-json>
+
+function runedit {
+    if [[ -z "$ONLY" || "$1" == "$ONLY" ]]; then
+        OUTPUT=$(printf "$4" | ./jv "$2" "$3")
+        if [[ "$OUTPUT" != "$5" ]]; then
+            echo "$1 failed"
+            echo "  expected: $5"
+            echo "  output: $OUTPUT"
+            exit 1
+        fi
+        echo "$1 OK"
+    fi
+}
+
+# Same as run, but jv reads the JSON from a (seekable) file.
+#
+#   format: runfile <test-name> <json> <path> <expected-value>
+
+function runfile {
+    if [[ -z "$ONLY" || "$1" == "$ONLY" ]]; then
+        printf "$2" > "$TMP/in.json"
+        OUTPUT=$(./jv "$TMP/in.json" "$3")
+        if [[ "$OUTPUT" != "$4" ]]; then
+            echo "$1 failed"
+            echo "  expected: $4"
+            echo "  output: $OUTPUT"
+            exit 1
+        fi
+        echo "$1 OK"
+    fi
+}
+
 # Check exit code.
 printf '{"a":1}' | jv a >/dev/null || [ $? -eq 0 ] || {
     echo "Failed exit code 0-1";
@@ -60,3 +114,316 @@ run "String" '[0, 1, "hi"]' '[2]' 'hi'
 run "Escape quote" '[0, 1, "hi\\"hi"]' '[2]' 'hi\"hi'
 run "Skip string" '[0, "hi", "there"]' '[2]' 'there'
 run "Stay in array" '{"a": [1, 2], "b": [3]}' 'a[2]' ''
+runfile "File collection" '{"a": 1, "b": {"c": [1, 2]}}' 'b' '{"c": [1, 2]}'
+runfile "File string" '{"a": "hi there", "b": 1}' 'a' 'hi there'
+runfile "File number" '{"a": 1, "b": 2}' 'b' '2'
+runfile "File truncated" '{"a": {"b": [1, 2' 'a' '{"b": [1, 2'
+run "Booleans" '{"a": true, "b": false, "c": 1}' 'b' 'false'
+run "Skip booleans" '[true, false, null, 3]' '[3]' '3'
+run "Escaped backslash" '{"a": "x\\\\", "b": 1}' 'b' '1'
+run "Key prefix" '{"ab": 1, "a": 2}' 'a' '2'
+run "Brackets in strings" '[["]", "}"], {"a": "[{"}, 5]' '[2]' '5'
+run "Skip many" '[0, 1, [2, [3]], {"x": 4}, 5, 6, 7]' '[6]' '7'
+run "Sibling key" '{"a": {"x": [1, {"b": 2}]}, "b": 3}' 'b' '3'
+run "Partial match" '{"a": {"x": 1}, "b": {"b": 2}}' 'a.b' ''
+run "Recursive" '{"a": {"id": 1, "b": [{"id": "x"}]}, "id": [2]}' '..id' "$(printf '1\nx\n[2]')"
+run "Recursive nested match" '[{"id": 1, "sub": {"id": 2}}]' '..sub.id' '2'
+run "Recursive below" '{"x": {"a": {"n": 1}}, "n": 2}' 'x..n' '1'
+run "Recursive no match" '{"x": "n"}' '..n' ''
+run "Recursive inside match" '{"id": {"id": 1}}' '..id' "$(printf '{"id": 1}\n1')"
+run "Recursive nested path" '{"a": {"a": {"b": 1}}}' '..a.b' '1'
+runfile "Recursive inside match file" '{"id": {"id": [{"id": 1}]}, "x": 2}' '..id' "$(printf '{"id": [{"id": 1}]}\n[{"id": 1}]\n1')"
+run "Recursive twice" '{"a": {"x": {"b": 1}, "a": [{"b": 2}]}}' '..a..b' "$(printf '1\n2')"
+run "Recursive then wildcard" '{"a": [1, {"a": [2]}]}' '..a[*]' "$(printf '1\n{"a": [2]}\n2')"
+
+# Batch mode: one line per match, prefixed by file name, in file order.
+printf '{"a": 1}' > "$TMP/b1.json"
+printf '{"b": 2}' > "$TMP/b2.json"
+printf '{"a": [3]}' > "$TMP/b3.json"
+OUTPUT=$(cd "$TMP" && "$OLDPWD/jv" b1.json b2.json b3.json a)
+if [[ "$OUTPUT" != "$(printf 'b1.json:1\nb3.json:[3]')" ]]; then
+    echo "Batch failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+echo "Batch OK"
+printf 'b3.json\nb2.json\nb1.json\n' > "$TMP/list.txt"
+OUTPUT=$(cd "$TMP" && "$OLDPWD/jv" -j 2 --files-from list.txt a)
+if [[ "$OUTPUT" != "$(printf 'b3.json:[3]\nb1.json:1')" ]]; then
+    echo "Batch files-from failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+echo "Batch files-from OK"
+runfile "Last element" '{"features": [1, 2, {"a": "x\\\\"}], "type": "FC"}\n' 'features[-1].a' 'x\\'
+runfile "Negative index" '{"features": [1, "]", 3], "type": "FC"}' 'features[-2]' ']'
+runfile "Negative then forward" '[[1, [2, 3]], [4, [5, 6]]]' '[-1][1][0]' '5'
+runfile "Negative out of range" '[1, 2]' '[-3]' ''
+runfile "Negative index anchor" '{"a": [1], "s": "[9, 8", "a": [2], "b": [3]}' 'a[-1]' '1'
+runfile "Forward then negative" '[[1, 2], [3, [4, 5]]]' '[1][1][-2]' '4'
+runfile "Negative from the end" '[1, {"a": "]"}, [2, "x]"]]\n\n' '[-1][-1]' 'x]'
+runfile "Negative in known element" '[[1, 2], [3, 4]]' '[-2][-1]' '2'
+runfile "Negative with brackets in key" '{"[-1]": [7, 8]}' '["[-1]"]' '[7, 8]'
+runwith "Compact" '--compact' '{"a": [1, 2], "b": { "c" : "x y, z" }}' '' '{"a":[1,2],"b":{"c":"x y, z"}}'
+runwith "Compact scalar" '--compact' '{"a": "x y"}' 'a' 'x y'
+runwith "Indent" '--indent 2' '{"a":[1,{"b":null}],"c":{},"d":[ ]}' '' "$(printf '{\n  "a": [\n    1,\n    {\n      "b": null\n    }\n  ],\n  "c": {},\n  "d": []\n}')"
+run "Wildcard" '{"a": [{"b": 1}, {"c": 2}, {"b": [3]}]}' 'a[*].b' "$(printf '1\n[3]')"
+runwith "Length" '--length' '{"a": [1, [2, 3], {"b": ","}], "n": 0}' 'a' '3'
+runwith "Length empty" '--length' '{"a": { }}' 'a' '0'
+runwith "Keys" '--keys' '{"a": {"x": [1, 2], "y\\"z": {"w": 1}, "": null}}' 'a' "$(printf 'x\ny\\"z\n')"
+runwith "Count" '--count' '[{"n": 1}, {"m": 2}, {"n": null}]' '[*].n' '2'
+runwith "Sum" '--sum' '[{"n": 1}, {"n": "x"}, {"n": 2.5}]' '[*].n' '3.5'
+runwith "Min" '--min' '[{"n": 10}, {"n": -1e1}, {"n": 2}]' '[*].n' '-10'
+runwith "Max" '--max' '[{"n": 10}, {"n": 123456789}, {"n": 2}]' '[*].n' '123456789'
+runwith "Sum long number" '--sum' "[1.$(printf '%070d' 0)e5]" '[*]' '100000'
+runwith "Lines" '--lines' '{"a": 1}\n{"b": 2}\n[{"a": 3}]\n{"a": [4]}' 'a' "$(printf '1\n[4]')"
+
+# --state resumes after the last complete document.
+printf '{"a": 1}\n{"a": 2}\n{"a": ' > "$TMP/log.ndjson"
+./jv --lines --state "$TMP/log.state" "$TMP/log.ndjson" a > /dev/null
+printf '3}\n' >> "$TMP/log.ndjson"
+OUTPUT=$(./jv --lines --state "$TMP/log.state" "$TMP/log.ndjson" a)
+if [[ "$OUTPUT" != "3" ]]; then
+    echo "Lines state failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+echo "Lines state OK"
+runedit "Set" '--set' 'a.b=[1,2]' '{"a": {"b": "x", "c": 1}, "b": 2}' '{"a": {"b": [1,2], "c": 1}, "b": 2}'
+runedit "Set element" '--set' '[1]={}' '[1, 2, 3]' '[1, {}, 3]'
+runedit "Delete first" '--delete' 'a' '{"a": {"b": 1}, "c": 2}' '{"c": 2}'
+runedit "Delete last" '--delete' 'c' '{"a": {"b": 1}, "c": 2}' '{"a": {"b": 1}}'
+runedit "Delete only" '--delete' 'x.a' '{"x": {"a": 1}}' '{"x": {}}'
+runedit "Delete element" '--delete' '[1]' '[1, [2, ","], 3]' '[1, 3]'
+runedit "Edit no match" '--delete' 'a.z' '{"a": {"b": 1}}' '{"a": {"b": 1}}'
+
+# Split an array into NDJSON shards, round-robin.
+printf '{"f": [1, "a b", {"x": [1, 2]}, [ ], null]}' | ./jv --split f -n 2 -o "$TMP/shards"
+OUTPUT=$(cat "$TMP/shards/part-00000.ndjson" "$TMP/shards/part-00001.ndjson")
+if [[ "$OUTPUT" != "$(printf '1\n{"x":[1,2]}\nnull\n"a b"\n[]')" ]]; then
+    echo "Split failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+printf '{"f": 1}' | ./jv --split g -n 2 -o "$TMP/none"
+if [[ $? -eq 0 || -e "$TMP/none" ]]; then
+    echo "Split no match failed"
+    exit 1
+fi
+echo "Split OK"
+
+# Columnar output: header, one batch of two rows, then an empty batch.
+OUTPUT=$(printf '[{"a": 1, "s": "x"}, {"s": "\\u00e9"}]' | ./jv --columns 'a:int64,s:string' '[*]' | od -An -tx1 | tr -d ' \n')
+EXPECTED="4a56434f4c533100""02000000""0101000000""61""0301000000""73"
+EXPECTED+="02000000""01""01000000000000000000000000000000"
+EXPECTED+="03""000000000100000003000000""78c3a9""00000000"
+if [[ "$OUTPUT" != "$EXPECTED" ]]; then
+    echo "Columns failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+OUTPUT=$(printf '[{"a": 1.9}, {"a": 1e30}, {"a": 2e0}, {"a": 9223372036854775808}]' | ./jv --columns 'a:int64' '[*]' | od -An -tx1 | tr -d ' \n')
+EXPECTED="4a56434f4c533100""01000000""0101000000""61"
+EXPECTED+="04000000""04""0000000000000000""0000000000000000""0200000000000000""0000000000000000""00000000"
+if [[ "$OUTPUT" != "$EXPECTED" ]]; then
+    echo "Columns int64 range failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+OUTPUT=$(printf '[{"a": true, "b": 5, "c": false}, {"a": 3, "b": true, "c": 2.5}]' | ./jv --columns 'a:int64,b:bool,c:double' '[*]' | od -An -tx1 | tr -d ' \n')
+EXPECTED="4a56434f4c533100""03000000""0101000000""61""0401000000""62""0201000000""63"
+EXPECTED+="02000000""02""0000000000000000""0300000000000000""02""0001""02""0000000000000000""0000000000000440""00000000"
+if [[ "$OUTPUT" != "$EXPECTED" ]]; then
+    echo "Columns types failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+echo "Columns OK"
+
+# Shape inference: one line per path pattern.
+OUTPUT=$(printf '[{"a": 1}, {"a": "xy", "b": null}]' | ./jv --schema --key-counts '')
+EXPECTED='{"path": "", "count": 1, "types": {"array": 1}, "items": [2, 2]}
+{"path": "[*]", "count": 2, "types": {"object": 2}, "keys": {"a": 2, "b": 1}}
+{"path": "[*].a", "count": 2, "types": {"string": 1, "number": 1}, "length": [2, 2], "range": [1, 1]}
+{"path": "[*].b", "count": 1, "types": {"null": 1}}'
+if [[ "$OUTPUT" != "$EXPECTED" ]]; then
+    echo "Schema failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+printf '"abc"' > "$TMP/in.json"
+OUTPUT=$(./jv --schema "$TMP/in.json" '' < /dev/null)
+if [[ "$OUTPUT" != '{"path": "", "count": 1, "types": {"string": 1}, "length": [3, 3]}' ]]; then
+    echo "Schema file failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+# A lone argument is the path, even if a file has its name.
+printf '"abc"' > "$TMP/data"
+OUTPUT=$(cd "$TMP" && printf '{"data": [1]}' | "$OLDPWD/jv" --schema data)
+if [[ "$OUTPUT" != '{"path": "data", "count": 1, "types": {"array": 1}, "items": [1, 1]}
+{"path": "data[*]", "count": 1, "types": {"number": 1}, "range": [1, 1]}' ]]; then
+    echo "Schema path failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+echo "Schema OK"
+
+# Diff two files: changed, added and removed paths.
+printf '{"a": [1, 2, 3], "b": {"c": "x", "d": null}, "e": 1}' > "$TMP/a.json"
+printf '{"a": [1, 5], "b": {"c": "x", "f": true, "d": null}, "e": 1}' > "$TMP/b.json"
+OUTPUT=$(./jv --diff "$TMP/a.json" "$TMP/b.json")
+EXPECTED='{"op": "changed", "path": "a[1]", "from": 2, "to": 5}
+{"op": "removed", "path": "a[2]", "value": 3}
+{"op": "added", "path": "b.f", "value": true}'
+if [[ "$OUTPUT" != "$EXPECTED" ]]; then
+    echo "Diff failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+./jv --diff "$TMP/a.json" "$TMP/b.json" > /dev/null
+CODE=$?
+./jv --diff "$TMP/a.json" "$TMP/a.json" > /dev/null
+if [[ $CODE -ne 13 || $? -ne 0 ]]; then
+    echo "Diff exit code failed"
+    exit 1
+fi
+printf '{"x": [{"k": 1, "m": [1, 2]}, {"k": 2}], "y": 3, "z": [1]}' > "$TMP/a.json"
+printf '{"x": [{"k": 1, "m": [1, 3]}, {"k": 2, "n": 0}], "y": 4, "z": [1]}' > "$TMP/b.json"
+OUTPUT=$(./jv --diff "$TMP/a.json" "$TMP/b.json")
+EXPECTED='{"op": "changed", "path": "x[0].m[1]", "from": 2, "to": 3}
+{"op": "added", "path": "x[1].n", "value": 0}
+{"op": "changed", "path": "y", "from": 3, "to": 4}'
+if [[ "$OUTPUT" != "$EXPECTED" ]]; then
+    echo "Diff nested failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+# Dots inside a bracketed name do not make a recursive path.
+printf '{"a..b": [1]}' > "$TMP/a.json"
+printf '{"a..b": [2]}' > "$TMP/b.json"
+OUTPUT=$(./jv --diff "$TMP/a.json" "$TMP/b.json" '["a..b"]')
+if [[ "$OUTPUT" != '{"op": "changed", "path": "[\"a..b\"][0]", "from": 1, "to": 2}' ]]; then
+    echo "Diff bracketed name failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+echo "Diff OK"
+
+# Binary output: CBOR and MessagePack.
+OUTPUT=$(printf '{"a": [1, -1, 300, "\\u00e9", {"k": null}, true, 1.5]}' | ./jv --format cbor a | od -An -tx1 | tr -d ' \n')
+if [[ "$OUTPUT" != "9f012019012c62c3a9bf616bf6fff5fb3ff8000000000000ff" ]]; then
+    echo "CBOR failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+echo "CBOR OK"
+
+OUTPUT=$(printf '{"a": [1, -1, 300, "\\u00e9", {"k": null}, true, 1.5]}' | ./jv --format msgpack a | od -An -tx1 | tr -d ' \n')
+if [[ "$OUTPUT" != "dd0000000701ffcd012ca2c3a9df00000001a16bc0c3cb3ff8000000000000" ]]; then
+    echo "MessagePack failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+# A literal longer than any fixed buffer still comes out as a float64.
+LONG=$(printf '1234567890%.0s' 1 2 3 4 5 6 7)
+OUTPUT=$(printf "{\"a\": [$LONG, -$LONG.5e-3]}" | ./jv --format msgpack a | od -An -tx1 | tr -d ' \n')
+if [[ "$OUTPUT" != "dd00000002cb4e46e5762616fa13cbcda77222f7e66055" ]]; then
+    echo "MessagePack long number failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+# From a file, counted first and streamed: the same bytes.
+printf '{"a": [1, -1, 300, "\\u00e9", {"k": null}, true, 1.5]}' > "$TMP/in.json"
+OUTPUT=$(./jv --format msgpack "$TMP/in.json" a | od -An -tx1 | tr -d ' \n')
+if [[ "$OUTPUT" != "dd0000000701ffcd012ca2c3a9df00000001a16bc0c3cb3ff8000000000000" ]]; then
+    echo "MessagePack file failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+# -0 stays a float; past INT64_MAX is still an integer, unsigned.
+OUTPUT=$(printf '[-0, 18446744073709551615]' | ./jv --format msgpack '' | od -An -tx1 | tr -d ' \n')
+if [[ "$OUTPUT" != "dd00000002cb8000000000000000cfffffffffffffffff" ]]; then
+    echo "MessagePack -0 and uint64 failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+OUTPUT=$(printf '[-0, 18446744073709551615]' | ./jv --format cbor '' | od -An -tx1 | tr -d ' \n')
+if [[ "$OUTPUT" != "9ffb80000000000000001bffffffffffffffffff" ]]; then
+    echo "CBOR -0 and uint64 failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+echo "MessagePack OK"
+
+# Reservoir sampling: K matches, in input order, reproducible with a seed.
+OUTPUT=$(printf '[0, 1, 2, 3, 4, 5, 6, 7, 8, 9]' | ./jv --sample 3 --seed 42 '[*]' | tr '\n' ' ')
+AGAIN=$(printf '[0, 1, 2, 3, 4, 5, 6, 7, 8, 9]' | ./jv --sample 3 --seed 42 '[*]' | tr '\n' ' ')
+if [[ ! "$OUTPUT" =~ ^[0-9]\ [0-9]\ [0-9]\ $ || "$OUTPUT" != "$AGAIN" ||
+        "$(echo $OUTPUT | tr ' ' '\n' | sort -n | tr '\n' ' ')" != "$OUTPUT" ]]; then
+    echo "Sample failed"
+    echo "  output: $OUTPUT"
+    exit 1
+fi
+# A seed without a sample is a usage error, not ignored.
+printf '[0, 1]' | ./jv --seed 42 '[*]' >/dev/null 2>&1 && {
+    echo "Sample seed failed";
+    exit 1;
+}
+echo "Sample OK"
+
+# Library: slice_value() points into the input when it can, and an arena
+# that is reset is reused without growing.
+cat > "$TMP/slice.c" <<'EOF'
+#include "jv.c"
+
+int main(void) {
+    const char *json = "{\"a\": [1, \"x y\"], \"b\": \"q\"}";
+    struct json_stream_t stream;
+    struct output_t out;
+    struct arena_t arena;
+    size_t size = 0;
+    FILE *fp;
+    int i;
+
+    init_arena(&arena);
+    init_arena_output(&out, &arena);
+
+    init_stream_string(&stream, json);
+    if (scan_value(&stream, "a")[0] != '\0' || slice_value(&stream, &out) != OK) return 1;
+    if (out.slice < json || out.slice + out.slice_len > json + strlen(json)) return 2;
+    if (out.slice_len != 10 || strncmp(out.slice, "[1, \"x y\"]", 10) != 0 || arena.used != 0) return 3;
+
+    fp = tmpfile();
+    fputs(json, fp);
+    rewind(fp);
+    init_stream(&stream, fp);
+    if (scan_value(&stream, "b")[0] != '\0' || slice_value(&stream, &out) != OK) return 4;
+    if (out.slice < stream.buffer || out.slice + out.slice_len > stream.buffer + JVBUF) return 5;
+    if (out.slice_len != 1 || out.slice[0] != 'q' || arena.used != 0) return 6;
+
+    // Longer than a buffer: copied into the arena.
+    rewind(fp);
+    fputs("{\"c\": \"", fp);
+    for (i = 0; i < 3 * JVBUF; i++) fputc('x', fp);
+    fputs("\", \"d\": 1}", fp);
+    for (i = 0; i < 3; i++) {
+        rewind(fp);
+        init_stream(&stream, fp);
+        reset_arena(&arena);
+        if (scan_value(&stream, "c")[0] != '\0' || slice_value(&stream, &out) != OK) return 7;
+        if (out.slice != arena.data + 1 || out.slice_len != 3 * JVBUF || out.slice[3 * JVBUF - 1] != 'x') return 8;
+        if (i == 0) size = arena.size;
+        else if (arena.size != size) return 9;
+    }
+    return 0;
+}
+EOF
+gcc -I. -o "$TMP/slice" "$TMP/slice.c" && "$TMP/slice"
+CODE=$?
+if [[ $CODE -ne 0 ]]; then
+    echo "Slice failed"
+    echo "  code: $CODE"
+    exit 1
+fi
+echo "Slice OK"